@@ -0,0 +1,167 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ac.h"
+#include "util.h"
+
+#define FOLD(c)    ((unsigned)(c) - 'A' < 26u ? (c) | 0x20 : (c))
+#define BYTE(s, j) (icase ? FOLD((unsigned char)(s)[(j)]) : (unsigned char)(s)[(j)])
+
+struct Ac {
+	unsigned char cls[256]; /* input byte to column, 0 for bytes in no pattern */
+	int ncls;
+	int *delta;             /* next row by row and column, failures resolved;
+	                         * a last column holds the node of the row */
+	int outrow;             /* rows from here on have output */
+	uint64_t *out;          /* patterns ending at a node or a suffix of it */
+	/* the trie and the work space of ac_build(), kept for the next one */
+	int *trie, *fail, *queue;
+	uint64_t *tout;
+	size_t nodesiz, triesiz, deltasiz;
+};
+
+Ac *
+ac_new(void)
+{
+	return ecalloc(1, sizeof(Ac));
+}
+
+void
+ac_build(Ac *a, char **pats, const size_t *lens, int n, int icase)
+{
+	int i, c, u, v, f, nnodes = 1, head = 0, tail = 0, *id;
+	unsigned char col[256] = { 0 };
+	size_t j, total = 0;
+
+	/* columns only for the bytes that occur, the others lead to the root */
+	a->ncls = 0;
+	for (i = 0; i < n; i++) {
+		total += lens[i];
+		for (j = 0; j < lens[i]; j++)
+			if (!col[BYTE(pats[i], j)])
+				col[BYTE(pats[i], j)] = ++a->ncls;
+	}
+	a->ncls++;
+	for (c = 0; c < 256; c++)
+		a->cls[c] = col[icase ? FOLD(c) : c];
+
+	/* memory only grows, a query like the last one allocates nothing */
+	if (total + 1 > a->nodesiz) {
+		free(a->out);
+		free(a->tout);
+		free(a->fail);
+		free(a->queue);
+		a->nodesiz = total + 1;
+		a->out = ecalloc(a->nodesiz, sizeof(*a->out));
+		a->tout = ecalloc(a->nodesiz, sizeof(*a->tout));
+		a->fail = ecalloc(a->nodesiz, sizeof(*a->fail));
+		a->queue = ecalloc(a->nodesiz, sizeof(*a->queue));
+	}
+	if ((total + 1) * a->ncls > a->triesiz) {
+		free(a->trie);
+		a->triesiz = (total + 1) * a->ncls;
+		a->trie = ecalloc(a->triesiz, sizeof(*a->trie));
+	}
+	if ((total + 1) * (a->ncls + 1) > a->deltasiz) {
+		free(a->delta);
+		a->deltasiz = (total + 1) * (a->ncls + 1);
+		a->delta = ecalloc(a->deltasiz, sizeof(*a->delta));
+	}
+	memset(a->trie, 0, (total + 1) * a->ncls * sizeof(*a->trie));
+	memset(a->tout, 0, (total + 1) * sizeof(*a->tout));
+
+	/* the trie, 0 standing for no edge as nothing leads back to the root */
+	for (i = 0; i < n; i++) {
+		for (u = 0, j = 0; j < lens[i]; j++) {
+			c = col[BYTE(pats[i], j)];
+			if (!a->trie[u * a->ncls + c])
+				a->trie[u * a->ncls + c] = nnodes++;
+			u = a->trie[u * a->ncls + c];
+		}
+		a->tout[u] |= (uint64_t)1 << i;
+	}
+	/* breadth first, each node takes the missing edges and the output of
+	 * its failure node, the longest proper suffix in the trie */
+	for (c = 0; c < a->ncls; c++)
+		if ((v = a->trie[c])) {
+			a->fail[v] = 0;
+			a->queue[tail++] = v;
+		}
+	while (head < tail) {
+		u = a->queue[head++];
+		for (c = 0; c < a->ncls; c++) {
+			f = a->trie[a->fail[u] * a->ncls + c];
+			if ((v = a->trie[u * a->ncls + c])) {
+				a->fail[v] = f;
+				a->tout[v] |= a->tout[f];
+				a->queue[tail++] = v;
+			} else {
+				a->trie[u * a->ncls + c] = f;
+			}
+		}
+	}
+	/* renumbered so the scan tells output by the row alone, which it holds
+	 * as an offset into delta; the root, without output, stays first */
+	id = a->fail;
+	for (u = 0, v = 0; u < nnodes; u++)
+		if (!a->tout[u])
+			id[u] = v++;
+	a->outrow = v * (a->ncls + 1);
+	for (u = 0; u < nnodes; u++)
+		if (a->tout[u])
+			id[u] = v++;
+	for (u = 0; u < nnodes; u++) {
+		a->out[id[u]] = a->tout[u];
+		for (c = 0; c < a->ncls; c++)
+			a->delta[id[u] * (a->ncls + 1) + c] = id[a->trie[u * a->ncls + c]] * (a->ncls + 1);
+		a->delta[id[u] * (a->ncls + 1) + a->ncls] = id[u];
+	}
+}
+
+int
+ac_match(const Ac *a, const char *s, size_t len, uint64_t want, uint64_t reject)
+{
+	const unsigned char *p = (const unsigned char *)s, *end = p + len;
+	uint64_t seen = 0;
+	int u = 0;
+
+	for (; p < end; p++) {
+		if ((u = a->delta[u + a->cls[*p]]) < a->outrow)
+			continue;
+		seen |= a->out[a->delta[u + a->ncls]];
+		if (seen & reject)
+			return 0;
+		if (!reject && (seen & want) == want)
+			return 1;
+	}
+	return (seen & want) == want;
+}
+
+uint64_t
+ac_seen(const Ac *a, const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s, *end = p + len;
+	uint64_t seen = 0;
+	int u = 0;
+
+	for (; p < end; p++)
+		if ((u = a->delta[u + a->cls[*p]]) >= a->outrow)
+			seen |= a->out[a->delta[u + a->ncls]];
+	return seen;
+}
+
+void
+ac_free(Ac *a)
+{
+	if (!a)
+		return;
+	free(a->delta);
+	free(a->out);
+	free(a->trie);
+	free(a->tout);
+	free(a->fail);
+	free(a->queue);
+	free(a);
+}
@@ -0,0 +1,19 @@
+/* See LICENSE file for copyright and license details. */
+
+/*
+ * Aho-Corasick automaton over up to 64 patterns, so an item is scanned once
+ * for all query tokens that may be anywhere in it. ac_build() reuses the
+ * memory of the automaton it rebuilds. With icase patterns and input are
+ * folded alike, ASCII letters only as in the find kernels. ac_match() is true
+ * if s holds every pattern in want and none in reject, bit i standing for
+ * pattern i; it stops as soon as that is known. ac_seen() tells all the
+ * patterns in s. Needs <stdint.h>.
+ */
+
+typedef struct Ac Ac;
+
+Ac *ac_new(void);
+void ac_build(Ac *a, char **pats, const size_t *lens, int n, int icase);
+int ac_match(const Ac *a, const char *s, size_t len, uint64_t want, uint64_t reject);
+uint64_t ac_seen(const Ac *a, const char *s, size_t len);
+void ac_free(Ac *a);
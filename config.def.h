@@ -13,6 +13,28 @@ static int input = 1;
 /* -F option; if 0, dmenu doesn't use fuzzy matching */
 static int fuzzy = 0;
 
+/* -r option; if 1, the query is a regular expression */
+static int regex = 0;
+
+/* -x option; if 1, dmenu runs the selection instead of printing it */
+static int execute = 0;
+
+/* -u option; if 1, dmenu only keeps the first of identical lines */
+static int dedup = 0;
+
+/* -H option; number of entries kept in the history file */
+static int histsize = 1000;
+
+/* -H option; days after which a history entry counts half as much */
+static int histhalflife = 14;
+
+/* -q option; number of queries kept in the query cache file */
+static int qcachesize = 256;
+
+/* -c option; milliseconds the query has to stay unchanged before the command
+ * runs, and between redraws while its output comes in */
+static int provider_delay = 50;
+
 /* -M option; if 0, dmenu doesn't allow for multi selection */
 static int multiselect = 0;
 
@@ -37,6 +59,10 @@ static int border_margin = 25;
 /* amount of pixel between the prompt and other list items */
 static int prompt_offset = 10; 
 
+/* most redraws per second while events keep coming in, best set to the
+ * refresh rate of the display; 0 redraws after every batch of events */
+static int frame_rate = 0;
+
 /* Amount of opacity. 0xff is opaque */
 static int alpha = 0xcc;
 
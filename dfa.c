@@ -0,0 +1,602 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfa.h"
+#include "util.h"
+
+#define MAXNODES   65536      /* NFA size, bounds the work per input byte */
+#define MAXSTATES  1024       /* DFA states cached, about 1 KiB each */
+#define MAXSETS    (1 << 20)  /* NFA ids held by the cached states */
+#define FOLD(c)    ((unsigned)(c) - 'A' < 26u ? (c) | 0x20 : (c))
+
+enum { Byte, Split, Jmp, Bol, Eol, Match };
+
+typedef struct {
+	unsigned char op, lo, hi;
+	int out[2]; /* while dangling, the next slot of the patch list */
+} Node;
+
+/* a piece of NFA; outs lists its dangling exits as slots node * 2 + i */
+typedef struct {
+	int start, outs;
+} Frag;
+
+typedef struct {
+	int set, n;      /* NFA ids of the state, a run of sets */
+	int next[256];   /* state after each byte, -1 if not built yet */
+	unsigned char match, eolmatch;
+} State;
+
+struct Dfa {
+	Node *nfa;
+	int nnodes, nodesiz, start, icase;
+	const char *p, *err;   /* while parsing */
+	State *states;
+	int nstates, statesiz;
+	int *sets;
+	size_t nsets, setssiz;
+	int htab[MAXSTATES * 2]; /* state + 1 by hash of its set */
+	unsigned int *mark, gen; /* closure visits */
+	int *stack, *buf[3];
+	int worksiz;             /* nodes the arrays above have room for */
+	int full;                /* states ran out */
+};
+
+static int parsealt(Dfa *d, Frag *f);
+
+static int
+node(Dfa *d, int op, int lo, int hi, int out0, int out1)
+{
+	if (d->nnodes == MAXNODES) {
+		d->err = "pattern too large";
+		return -1;
+	}
+	if (d->nnodes == d->nodesiz) {
+		d->nodesiz = d->nodesiz ? d->nodesiz * 2 : 64;
+		if (!(d->nfa = realloc(d->nfa, d->nodesiz * sizeof(*d->nfa))))
+			die("cannot realloc %zu bytes:", d->nodesiz * sizeof(*d->nfa));
+	}
+	d->nfa[d->nnodes] = (Node){ op, lo, hi, { out0, out1 } };
+	return d->nnodes++;
+}
+
+static void
+patch(Dfa *d, int l, int target)
+{
+	int next;
+
+	for (; l != -1; l = next) {
+		next = d->nfa[l >> 1].out[l & 1];
+		d->nfa[l >> 1].out[l & 1] = target;
+	}
+}
+
+static int
+append(Dfa *d, int l1, int l2)
+{
+	int l = l1;
+
+	if (l1 == -1)
+		return l2;
+	while (d->nfa[l >> 1].out[l & 1] != -1)
+		l = d->nfa[l >> 1].out[l & 1];
+	d->nfa[l >> 1].out[l & 1] = l2;
+	return l1;
+}
+
+/* one node with a single dangling exit */
+static int
+single(Dfa *d, Frag *f, int op, int lo, int hi)
+{
+	int n;
+
+	if ((n = node(d, op, lo, hi, -1, -1)) == -1)
+		return 0;
+	*f = (Frag){ n, n * 2 };
+	return 1;
+}
+
+static void
+cat(Dfa *d, Frag *a, Frag b)
+{
+	patch(d, a->outs, b.start);
+	a->outs = b.outs;
+}
+
+static int
+alt(Dfa *d, Frag *a, Frag b)
+{
+	int n;
+
+	if ((n = node(d, Split, 0, 0, a->start, b.start)) == -1)
+		return 0;
+	*a = (Frag){ n, append(d, a->outs, b.outs) };
+	return 1;
+}
+
+/* adds the alternative of bytes lo to hi followed by cont continuation
+ * bytes, as UTF-8 has them */
+static int
+seq(Dfa *d, Frag *f, int lo, int hi, int cont)
+{
+	Frag g, c;
+
+	if (!single(d, &g, Byte, lo, hi))
+		return 0;
+	while (cont--) {
+		if (!single(d, &c, Byte, 0x80, 0xbf))
+			return 0;
+		cat(d, &g, c);
+	}
+	return f->start == -1 ? (*f = g, 1) : alt(d, f, g);
+}
+
+/* any character that is not ASCII, or a byte that is no valid UTF-8 */
+static int
+nonascii(Dfa *d, Frag *f)
+{
+	return seq(d, f, 0x80, 0xc1, 0) && seq(d, f, 0xf5, 0xff, 0) &&
+	       seq(d, f, 0xc2, 0xdf, 1) && seq(d, f, 0xe0, 0xef, 2) &&
+	       seq(d, f, 0xf0, 0xf4, 3);
+}
+
+/* a character, given as its UTF-8 bytes */
+static int
+literal(Dfa *d, Frag *f, const unsigned char *s, int len)
+{
+	Frag g;
+	int i, c;
+
+	for (i = 0; i < len; i++) {
+		c = d->icase ? FOLD(s[i]) : s[i];
+		if (!single(d, i ? &g : f, Byte, c, c))
+			return 0;
+		if (i)
+			cat(d, f, g);
+	}
+	return 1;
+}
+
+static int
+utf8len(const char *s)
+{
+	unsigned char c = *s;
+	int i, n = c < 0xc0 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+
+	/* a sequence cut short by the end of the pattern ends there */
+	for (i = 1; i < n && s[i]; i++)
+		;
+	return i;
+}
+
+static int
+parseclass(Dfa *d, Frag *f)
+{
+	unsigned char in[128] = { 0 };
+	int c, hi, neg, n, first = 1;
+	Frag g;
+
+	f->start = -1;
+	if ((neg = *d->p == '^'))
+		d->p++;
+	for (; first || *d->p != ']'; first = 0) {
+		if (!*d->p) {
+			d->err = "missing ]";
+			return 0;
+		}
+		if (*d->p == '\\' && d->p[1])
+			d->p++;
+		if ((unsigned char)*d->p >= 0x80) {
+			/* characters beyond ASCII are alternatives of their own */
+			if (neg) {
+				d->err = "non-ASCII character in negated class";
+				return 0;
+			}
+			n = utf8len(d->p);
+			if (!literal(d, &g, (const unsigned char *)d->p, n) ||
+			    (f->start != -1 && !alt(d, &g, *f)))
+				return 0;
+			*f = g;
+			d->p += n;
+			continue;
+		}
+		c = hi = *d->p++;
+		if (*d->p == '-' && d->p[1] && d->p[1] != ']') {
+			if ((unsigned char)d->p[1] >= 0x80) {
+				d->err = "non-ASCII range";
+				return 0;
+			}
+			hi = d->p[1];
+			d->p += 2;
+			if (hi < c) {
+				d->err = "invalid range";
+				return 0;
+			}
+		}
+		for (; c <= hi; c++)
+			in[d->icase ? FOLD(c) : c] = 1;
+	}
+	d->p++;
+	for (c = 0; c < 128; c = hi + 1) {
+		for (; c < 128 && in[c] == neg; c++)
+			;
+		for (hi = c; hi + 1 < 128 && in[hi + 1] != neg; hi++)
+			;
+		if (c < 128 && !seq(d, f, c, hi, 0))
+			return 0;
+	}
+	return !neg || nonascii(d, f);
+}
+
+static int
+parseatom(Dfa *d, Frag *f)
+{
+	int n;
+
+	switch (*d->p) {
+	case '(':
+		d->p++;
+		if (!parsealt(d, f))
+			return 0;
+		if (*d->p != ')') {
+			d->err = "missing )";
+			return 0;
+		}
+		d->p++;
+		return 1;
+	case '[':
+		d->p++;
+		return parseclass(d, f);
+	case '.':
+		d->p++;
+		f->start = -1;
+		return seq(d, f, 0x00, 0x7f, 0) && nonascii(d, f);
+	case '^':
+		d->p++;
+		return single(d, f, Bol, 0, 0);
+	case '$':
+		d->p++;
+		return single(d, f, Eol, 0, 0);
+	case '*':
+	case '+':
+	case '?':
+		d->err = "nothing to repeat";
+		return 0;
+	case '\\':
+		if (!*++d->p) {
+			d->err = "trailing \\";
+			return 0;
+		}
+		/* fallthrough */
+	default:
+		n = utf8len(d->p);
+		if (!literal(d, f, (const unsigned char *)d->p, n))
+			return 0;
+		d->p += n;
+		return 1;
+	}
+}
+
+static int
+parserep(Dfa *d, Frag *f)
+{
+	int n;
+
+	if (!parseatom(d, f))
+		return 0;
+	for (; *d->p == '*' || *d->p == '+' || *d->p == '?'; d->p++) {
+		if ((n = node(d, Split, 0, 0, f->start, -1)) == -1)
+			return 0;
+		switch (*d->p) {
+		case '*':
+			patch(d, f->outs, n);
+			*f = (Frag){ n, n * 2 + 1 };
+			break;
+		case '+':
+			patch(d, f->outs, n);
+			f->outs = n * 2 + 1;
+			break;
+		case '?':
+			*f = (Frag){ n, append(d, f->outs, n * 2 + 1) };
+			break;
+		}
+	}
+	return 1;
+}
+
+static int
+parsecat(Dfa *d, Frag *f)
+{
+	Frag g;
+
+	if (!single(d, f, Jmp, 0, 0))
+		return 0;
+	while (*d->p && *d->p != '|' && *d->p != ')') {
+		if (!parserep(d, &g))
+			return 0;
+		cat(d, f, g);
+	}
+	return 1;
+}
+
+static int
+parsealt(Dfa *d, Frag *f)
+{
+	Frag g;
+
+	if (!parsecat(d, f))
+		return 0;
+	while (*d->p == '|') {
+		d->p++;
+		if (!parsecat(d, &g) || !alt(d, f, g))
+			return 0;
+	}
+	return 1;
+}
+
+/* adds what node n reaches without input to the list l of n entries: the
+ * nodes that consume a byte, Match, and Eol as the end may come later */
+static void
+closure(Dfa *d, int n, int *l, int *nl, int bol, int eol)
+{
+	int sp = 0;
+	Node *x;
+
+	d->stack[sp++] = n;
+	while (sp) {
+		if ((n = d->stack[--sp]) < 0 || d->mark[n] == d->gen)
+			continue;
+		d->mark[n] = d->gen;
+		x = &d->nfa[n];
+		switch (x->op) {
+		case Split:
+			d->stack[sp++] = x->out[1];
+			/* fallthrough */
+		case Jmp:
+			d->stack[sp++] = x->out[0];
+			break;
+		case Bol:
+			if (bol)
+				d->stack[sp++] = x->out[0];
+			break;
+		case Eol:
+			l[(*nl)++] = n;
+			if (eol)
+				d->stack[sp++] = x->out[0];
+			break;
+		default:
+			l[(*nl)++] = n;
+		}
+	}
+}
+
+static void
+visit(Dfa *d)
+{
+	if (!++d->gen) {
+		memset(d->mark, 0, d->nnodes * sizeof(*d->mark));
+		d->gen = 1;
+	}
+}
+
+static int
+hasmatch(Dfa *d, const int *l, int n)
+{
+	while (n--)
+		if (d->nfa[l[n]].op == Match)
+			return 1;
+	return 0;
+}
+
+/* whether the list matches if the input ends here */
+static int
+endmatch(Dfa *d, const int *l, int n, int bol)
+{
+	int i, k = 0;
+
+	visit(d);
+	for (i = 0; i < n; i++)
+		if (d->nfa[l[i]].op == Eol)
+			closure(d, d->nfa[l[i]].out[0], d->buf[1], &k, bol, 1);
+	return hasmatch(d, l, n) || hasmatch(d, d->buf[1], k);
+}
+
+/* the list after byte c, into out; a match may also start after it */
+static int
+nfastep(Dfa *d, const int *l, int n, int c, int *out)
+{
+	int i, k = 0;
+	Node *x;
+
+	if (d->icase)
+		c = FOLD(c);
+	visit(d);
+	for (i = 0; i < n; i++) {
+		x = &d->nfa[l[i]];
+		if (x->op == Byte && x->lo <= c && c <= x->hi)
+			closure(d, x->out[0], out, &k, 0, 0);
+	}
+	closure(d, d->start, out, &k, 0, 0);
+	return k;
+}
+
+/* a heap of k ids in l, restored below j */
+static void
+sift(int *l, int j, int k)
+{
+	int c, t = l[j];
+
+	for (; (c = 2 * j + 1) < k; j = c) {
+		if (c + 1 < k && l[c + 1] > l[c])
+			c++;
+		if (l[c] <= t)
+			break;
+		l[j] = l[c];
+	}
+	l[j] = t;
+}
+
+/* heapsort, qsort(3) may allocate and the lists can be long */
+static void
+sortlist(int *l, int n)
+{
+	int i, t;
+
+	for (i = n / 2 - 1; i >= 0; i--)
+		sift(l, i, n);
+	while (--n > 0) {
+		t = l[0];
+		l[0] = l[n];
+		l[n] = t;
+		sift(l, 0, n);
+	}
+}
+
+/* the state of the list, made if new; -1 once the cache is full */
+static int
+addstate(Dfa *d, int *l, int n)
+{
+	unsigned int h = 2166136261u;
+	int i, s, *slot;
+	State *st;
+
+	sortlist(l, n);
+	for (i = 0; i < n; i++)
+		h = (h ^ l[i]) * 16777619u;
+	for (i = h % LENGTH(d->htab); (s = d->htab[i] - 1) != -1; i = (i + 1) % LENGTH(d->htab))
+		if (d->states[s].n == n && !memcmp(d->sets + d->states[s].set, l, n * sizeof(*l)))
+			return s;
+	slot = &d->htab[i];
+	if (d->nstates == MAXSTATES || d->nsets + n > MAXSETS) {
+		d->full = 1;
+		return -1;
+	}
+	if (d->nstates == d->statesiz) {
+		d->statesiz = d->statesiz ? d->statesiz * 2 : 16;
+		if (!(d->states = realloc(d->states, d->statesiz * sizeof(*d->states))))
+			die("cannot realloc %zu bytes:", d->statesiz * sizeof(*d->states));
+	}
+	if (d->nsets + n > d->setssiz) {
+		d->setssiz = MAX(d->setssiz * 2, d->nsets + n);
+		if (!(d->sets = realloc(d->sets, d->setssiz * sizeof(*d->sets))))
+			die("cannot realloc %zu bytes:", d->setssiz * sizeof(*d->sets));
+	}
+	memcpy(d->sets + d->nsets, l, n * sizeof(*l));
+	st = &d->states[s = d->nstates++];
+	st->set = d->nsets;
+	st->n = n;
+	d->nsets += n;
+	memset(st->next, -1, sizeof(st->next));
+	st->match = hasmatch(d, l, n);
+	st->eolmatch = endmatch(d, l, n, 0);
+	*slot = s + 1;
+	return s;
+}
+
+/* forgets all states and makes the start state, state 0 */
+static void
+flush(Dfa *d)
+{
+	int n = 0;
+
+	d->nstates = 0;
+	d->nsets = 0;
+	d->full = 0;
+	memset(d->htab, 0, sizeof(d->htab));
+	visit(d);
+	closure(d, d->start, d->buf[0], &n, 1, 0);
+	addstate(d, d->buf[0], n);
+}
+
+Dfa *
+dfa_new(void)
+{
+	return ecalloc(1, sizeof(Dfa));
+}
+
+int
+dfa_compile(Dfa *d, const char *re, int icase, const char **err)
+{
+	Frag f;
+	int i, m;
+
+	d->nnodes = 0;
+	d->err = NULL;
+	d->icase = icase;
+	d->p = re;
+	if (!parsealt(d, &f) || (*d->p && (d->err = "unmatched )")) ||
+	    (m = node(d, Match, 0, 0, -1, -1)) == -1) {
+		*err = d->err;
+		return 0;
+	}
+	patch(d, f.outs, m);
+	d->start = f.start;
+	/* the memory of earlier patterns is kept, grown only for a larger one */
+	if (d->nnodes > d->worksiz) {
+		d->worksiz = d->nnodes;
+		free(d->mark);
+		free(d->stack);
+		d->mark = ecalloc(d->worksiz, sizeof(*d->mark));
+		d->gen = 0;
+		/* each node is expanded once and pushes at most two */
+		d->stack = ecalloc(d->worksiz * 2 + 1, sizeof(*d->stack));
+		for (i = 0; i < 3; i++) {
+			free(d->buf[i]);
+			d->buf[i] = ecalloc(d->worksiz, sizeof(*d->buf[i]));
+		}
+	}
+	flush(d);
+	return 1;
+}
+
+int
+dfa_match(Dfa *d, const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s, *end = p + len;
+	int st = 0, next, n, *l, *t;
+	State *x;
+
+	if (d->full)
+		flush(d);
+	if (!len) /* the start and the end at once, as in ^$ */
+		return endmatch(d, d->sets, d->states[0].n, 1);
+	for (; p < end; st = next, p++) {
+		x = &d->states[st];
+		if (x->match)
+			return 1;
+		if ((next = x->next[*p]) != -1)
+			continue;
+		n = nfastep(d, d->sets + x->set, x->n, *p, d->buf[0]);
+		if ((next = addstate(d, d->buf[0], n)) == -1)
+			goto nfa;
+		d->states[st].next[*p] = next;
+	}
+	return d->states[st].match || d->states[st].eolmatch;
+
+nfa:
+	/* out of states: go on with the lists the cache would have held */
+	l = d->buf[0];
+	t = d->buf[2];
+	for (p++; !hasmatch(d, l, n) && p < end; p++) {
+		n = nfastep(d, l, n, *p, t);
+		memcpy(l, t, n * sizeof(*l));
+	}
+	return endmatch(d, l, n, 0);
+}
+
+void
+dfa_free(Dfa *d)
+{
+	if (!d)
+		return;
+	free(d->nfa);
+	free(d->states);
+	free(d->sets);
+	free(d->mark);
+	free(d->stack);
+	free(d->buf[0]);
+	free(d->buf[1]);
+	free(d->buf[2]);
+	free(d);
+}
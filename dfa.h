@@ -0,0 +1,17 @@
+/* See LICENSE file for copyright and license details. */
+
+/*
+ * Regular expressions for -r: POSIX extended syntax without back references,
+ * bounds and named classes, over UTF-8. dfa_match() looks for a match
+ * anywhere in s and builds the automaton lazily, a state per set of NFA
+ * states seen; once the cache of states is full the remaining input is
+ * simulated on the NFA, so the work stays linear in the input. dfa_compile()
+ * returns 0 for an invalid pattern and reuses the memory of the last one.
+ */
+
+typedef struct Dfa Dfa;
+
+Dfa *dfa_new(void);
+int dfa_compile(Dfa *d, const char *re, int icase, const char **err);
+int dfa_match(Dfa *d, const char *s, size_t len);
+void dfa_free(Dfa *d);
@@ -1,13 +1,23 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
@@ -19,7 +29,10 @@
 #include <X11/extensions/Xrender.h>
 #include <X11/Xft/Xft.h>
 
+#include "ac.h"
+#include "dfa.h"
 #include "drw.h"
+#include "idx.h"
 #include "util.h"
 #include "tomlc99/toml.h"
 
@@ -27,6 +40,22 @@
 #define INTERSECT(x,y,w,h,r)  (MAX(0, MIN((x)+(w),(r).x_org+(r).width)  - MAX((x),(r).x_org)) \
                              * MAX(0, MIN((y)+(h),(r).y_org+(r).height) - MAX((y),(r).y_org)))
 #define TEXTW(X)              (drw_fontset_getwidth(drw, (X)) + lrpad)
+#define ITEMTEXT(I)           (arena + itemoff[(I)])
+#define ITEMID(I)             (itemid ? itemid[(I)] : (I))
+#define ASCIIFOLD(C)          ((unsigned char)(C) - 'A' < 26u ? (C) | 0x20 : (C))
+
+#define QCACHEMAGIC           "DMQ3"
+#define QCACHEQUERY           16    /* queries up to 15 bytes are cached */
+#define QCACHETOP             64    /* matches kept per query */
+
+#define REGEXBUDGET           1000  /* ms a -r pattern may take over the items */
+#define FREQSAMPLE            65536 /* items the query planner counts bytes of */
+#define ACMIN                 5     /* terms anywhere that take one scan for all */
+#define ACCOST                2     /* a byte through the automaton, in finds */
+#define ACSAMPLE              256   /* items the plans are weighed on */
+#define SORTMIN               16384 /* items from which a sorted index is kept */
+#define SORTRUN               16    /* runs over 1/16 of the items are scanned */
+#define EXACTRANK             256   /* score gap over any prior, log2f(1 + FLT_MAX) */
 
 #define OPAQUE                0xffu
 
@@ -36,25 +65,123 @@
 /* enums */
 enum { SchemeNorm, SchemeSel, SchemeNormHighlight, SchemeSelHighlight,
        SchemeOut, SchemeBorder, SchemeLast }; /* color schemes */
-
-struct item {
-	char *text;
-	struct item *left, *right;
-	int id; /* for multiselect */
-	double distance;
-};
+enum { ItemAscii = IDX_ASCII }; /* item flags, shared with the -I index */
 
 static char numbers[NUMBERSBUFSIZE] = "";
 static char text[BUFSIZ] = "";
 static char *embed;
 static int bh, mw, mh;
 static int inputw = 0, promptw, passwd = 0;
+static int framed = 0; /* -B: length-prefixed records instead of lines */
+static int weighted = 0; /* -t: lines start with a weight column */
+static const char *indexfile; /* -I: items come from a dmenu_cache index */
+static char delim = '\n', outsep = '\n'; /* -0 uses NUL for both */
+static FILE *out; /* the selection goes to stdout, or with -x to runbuf */
+static char *runbuf;
+static size_t runlen;
 static int lrpad; /* sum of left and right padding */
 static size_t cursor;
-static struct item *items = NULL;
-static struct item *matches, *matchend;
-static struct item *prev, *curr, *next, *sel;
+/* item store: texts live NUL-terminated and back to back in one arena, an
+ * item is identified by its index (the id printed by -ix) */
+static char *arena;
+static size_t arenalen, arenasiz;
+/* the arena (-B) or the whole store (-I) may live in a private mapping */
+static char *map;
+static size_t mapsiz;
+static int arenamapped, indexmapped;
+static uint32_t *itemoff, *itemlen;
+static unsigned char *itemflags;
+static uint32_t *itemid; /* input line of each item, only kept with -u */
+/* -d: the item text is the match field, the display and output fields are
+ * other slices of the record, which is kept as read */
+static char fielddelim;
+static int matchfield, showfield, outfield; /* 0 is the whole record */
+static uint32_t *showoff, *showlen, *outoff, *outlen;
+static unsigned int nitems, itemsiz;
+static uint32_t nrecords; /* input record number, the -ix id */
+/* partial record left over by readitems() */
+static struct { char *buf; size_t len, siz; int eof; } rd;
+static struct hent { uint32_t id, hash; } *htab; /* -u: id + 1, 0 is empty */
+static unsigned int hsiz;
+/* -H: frecency history, one "count<TAB>last use<TAB>text" line per entry;
+ * texts point into the mapped file or, for new entries, into the items */
+static const char *histfile;
+static struct hist {
+	const char *s;
+	uint32_t len, count;
+	int64_t time;
+	float weight;
+} *hist;
+static unsigned int nhist, histcap;
+static char *histmap;
+static size_t histmapsiz;
+/* ranking bonus of each item, log2(1 + weight) of its -t weight column and
+ * history frecency; 0 for items without either */
+static float *itemprior;
+/* -q: top matches of short queries, shared by all item sets that use the
+ * same file and told apart by a hash of the store and matching mode */
+static const char *qcachefile;
+struct qheader {
+	char magic[4];
+	uint32_t n;
+};
+static struct qent {
+	uint64_t store;
+	uint64_t used; /* for LRU eviction */
+	uint32_t total, ntop, nscored;
+	char query[QCACHEQUERY]; /* NUL-padded */
+	uint32_t top[QCACHETOP];
+	float base[QCACHETOP]; /* score of the scored ones, less their prior */
+} *qcache;
+static unsigned int nqcache, qdirty;
+static uint64_t storekey, qclock;
+static unsigned int cachedtotal; /* matches only holds the cached top of these */
+/* -c: items come from a command run for each query; its output replaces
+ * the items once it starts, until then they are those of the last query */
+static const char *provider;
+static char provquery[sizeof text]; /* query of the last command started */
+static pid_t provpid;
+static int provfresh, provpending;
+static struct timespec provchanged;
+/* -c and -L read items while the menu runs, from feedfd */
+static int feedfd = -1, feeddirty;
+static struct timespec feeddrawn;
+static unsigned int matchsiz;
+/* -L: stdin never ends and only the newest live lines are kept. Their slots
+ * form a ring starting at the oldest, liveold, and their texts a ring in
+ * the arena, arenalen being where the next one goes. matches holds the
+ * matching lines newest first and is kept up to date line by line; it lies
+ * in livebuf, twice as large, to have room in front for new lines */
+static unsigned int live, liveold, livefull;
+static unsigned int *livebuf;
+
+/* the items by folded text, for prefix terms; sorted is set under sortlock
+ * once the thread is done, the item store does not change after loading */
+static unsigned int *sorted, *sortrun;
+static uint64_t *sortbits; /* a bit per item, to put a run back in order */
+static unsigned char sortfold[256];
+static pthread_mutex_t sortlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t sortthread;
+static int sorting;
+/* -fc: fallback fonts found by earlier runs, kept by drw */
+static const char *fontcachefile;
+/* active match set, as item ids; prev, curr, next and sel are positions in
+ * it and next == nmatches means there is no next page */
+static unsigned int *matches;
+static unsigned int nmatches;
+static uint64_t *scores, *scoretmp; /* sort keys, and room to sort them */
+static unsigned int scoresiz, nscored; /* matches put in order by scores */
+static unsigned int prev, curr, next, sel;
 static int mon = -1, screen;
+/* the menu changed or the window lost its contents; either is dealt with
+ * once per batch of events */
+static int redraw, exposed;
+static struct timespec lastframe;
+/* positions of the previous and next pages not warmed yet, see calcoffsets() */
+static unsigned int warmpos, warmend;
+#define WARMNEXT(p)  ((p) + 1 == curr ? next : (p) + 1)
+static int timing = 0; /* -T: report startup phases */
+static struct timespec starttime;
 static int *selid = NULL;
 static unsigned int selidsize = 0;
 
@@ -73,9 +200,12 @@ static Colormap cmap;
 
 #include "config.h"
 
-static char * cistrstr(const char *s, const char *sub);
+static int sensitive = 0;
 static int (*fstrncmp)(const char *, const char *, size_t) = strncasecmp;
-static char *(*fstrstr)(const char *, const char *) = cistrstr;
+/* match set builder for the mode, over the items from up to to */
+static void (*matcher)(unsigned int from, unsigned int to);
+static long msince(const struct timespec *t);
+static void stopprovider(void);
 static void xinitvisual();
 
 static int
@@ -94,17 +224,25 @@ textw_clamp(const char *str, unsigned int n)
 	return MIN(w, n);
 }
 
-static void
-appenditem(struct item *item, struct item **list, struct item **last)
+/* the text shown for item id; with -d a copy of the display field unless
+ * it ends the record, good until the next call */
+static const char *
+itemshow(unsigned int id)
 {
-	if (*last)
-		(*last)->right = item;
-	else
-		*list = item;
-
-	item->left = *last;
-	item->right = NULL;
-	*last = item;
+	static char *buf;
+	static size_t bufsiz;
+	const char *s;
+
+	if (!showoff)
+		return ITEMTEXT(id);
+	s = arena + showoff[id];
+	if (!s[showlen[id]])
+		return s;
+	if (showlen[id] >= bufsiz && !(buf = realloc(buf, bufsiz = showlen[id] + 1)))
+		die("cannot realloc %zu bytes:", bufsiz);
+	memcpy(buf, s, showlen[id]);
+	buf[showlen[id]] = '\0';
+	return buf;
 }
 
 static void
@@ -115,34 +253,108 @@ calcoffsets(void)
 	n = lines * bh;
 
 	/* calculate which items will begin the next page and previous page */
-	for (i = 0, next = curr; next; next = next->right)
-		if ((i += (lines > 0) ? bh : textw_clamp(next->text, n)) > n)
+	for (i = 0, next = curr; next < nmatches; next++)
+		if ((i += (lines > 0) ? bh : textw_clamp(itemshow(matches[next]), n)) > n)
 			break;
-	for (i = 0, prev = curr; prev && prev->left; prev = prev->left)
-		if ((i += (lines > 0) ? bh : textw_clamp(prev->left->text, n)) > n)
+	for (i = 0, prev = curr; prev > 0; prev--)
+		if ((i += (lines > 0) ? bh : textw_clamp(itemshow(matches[prev - 1]), n)) > n)
 			break;
+
+	/* the pages around this one get their fallback fonts looked up now
+	 * and their glyphs loaded while idle */
+	warmend = MIN(nmatches, next + (next - curr));
+	for (warmpos = prev; warmpos < warmend; warmpos = WARMNEXT(warmpos))
+		drw_prefetch(drw, itemshow(matches[warmpos]));
+	warmpos = prev < curr ? prev : next;
 }
 
 static int
 max_textw(void)
 {
 
-	if(!items)
+	if (!nitems)
 		return min_width;
 
 	// Max text length is based on the list item with the most characters
 	// This is fine for monospaced fonts, but not regular fonts
 	// But it is sooo much, much faster (especially on larger files)
-	struct item *max = NULL;
-	int maxl = 0;
+	unsigned int i, max = 0;
+	size_t len, maxlen = 0;
+
+	for (i = 0; i < nitems; i++)
+		if ((len = showoff ? showlen[i] : itemlen[i]) > maxlen) {
+			max = i;
+			maxlen = len;
+		}
+	return TEXTW(itemshow(max));
+}
 
-	for (struct item *item = items; item && item->text; item++) {
-		if (strlen(item->text) > maxl) {
-			max = item;
-			maxl = strlen(item->text);
+/* files are rewritten through a temporary file that is renamed into place,
+ * so that no reader ever sees a partial one */
+static FILE *
+opentemp(const char *file, char **tmp)
+{
+	size_t n = strlen(file) + sizeof(".XXXXXX");
+	FILE *fp = NULL;
+	int fd;
+
+	*tmp = ecalloc(n, 1);
+	snprintf(*tmp, n, "%s.XXXXXX", file);
+	if ((fd = mkstemp(*tmp)) == -1 || !(fp = fdopen(fd, "w"))) {
+		fprintf(stderr, "dmenu: cannot write %s: %s\n", *tmp, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+			unlink(*tmp);
 		}
+		free(*tmp);
+	}
+	return fp;
+}
+
+static void
+closetemp(FILE *fp, char *tmp, const char *file)
+{
+	if (fclose(fp) == EOF || rename(tmp, file) == -1) {
+		fprintf(stderr, "dmenu: cannot write %s: %s\n", file, strerror(errno));
+		unlink(tmp);
 	}
-	return TEXTW(max->text);
+	free(tmp);
+}
+
+static void
+writeqcache(void)
+{
+	struct qheader h = { QCACHEMAGIC, nqcache };
+	char *tmp;
+	FILE *fp;
+
+	if (!(fp = opentemp(qcachefile, &tmp)))
+		return;
+	fwrite(&h, sizeof(h), 1, fp);
+	fwrite(qcache, sizeof(*qcache), nqcache, fp);
+	closetemp(fp, tmp, qcachefile);
+}
+
+static void
+loadfontcache(void)
+{
+	FILE *fp = fopen(fontcachefile, "r");
+
+	drw_fallback_load(drw, fp);
+	if (fp)
+		fclose(fp);
+}
+
+static void
+writefontcache(void)
+{
+	char *tmp;
+	FILE *fp;
+
+	if (!(fp = opentemp(fontcachefile, &tmp)))
+		return;
+	drw_fallback_write(drw, fp);
+	closetemp(fp, tmp, fontcachefile);
 }
 
 static void
@@ -163,122 +375,461 @@ cleanup_cfg(void)
 	free((void *) colors[SchemeBorder][ColBg]);
 }
 
+/* saves what later runs read; the rest the exit undoes faster, item by
+ * item only when built with LEAKCHECK */
 static void
 cleanup(void)
 {
+#ifdef LEAKCHECK
 	size_t i;
+#endif
 
+	if (qdirty)
+		writeqcache();
+	stopprovider();
+	if (fontcachefile && drw->fbdirty)
+		writefontcache();
+#ifdef LEAKCHECK
 	XUngrabKeyboard(dpy, CurrentTime);
 	for (i = 0; i < SchemeLast; i++) {
 		drw_scm_free(drw, scheme[i], 2);
 		free(scheme[i]);
 	}
-	for (i = 0; items && items[i].text; ++i)
-		free(items[i].text);
-	free(items);
+	if (sorting && (errno = pthread_join(sortthread, NULL)))
+		die("pthread_join:");
+	free(sorted);
+	free(sortrun);
+	free(sortbits);
+	if (!arenamapped)
+		free(arena);
+	if (!indexmapped) {
+		free(itemoff);
+		free(itemlen);
+		free(itemflags);
+	}
+	if (map)
+		munmap(map, mapsiz);
+	free(itemid);
+	free(showoff);
+	free(showlen);
+	free(outoff);
+	free(outlen);
+	free(htab);
+	free(live ? livebuf : matches);
+	free(scores);
+	free(scoretmp);
+	free(itemprior);
+	free(hist);
+	free(qcache);
+	if (histmap)
+		munmap(histmap, histmapsiz);
 	drw_free(drw);
 	XSync(dpy, False);
 	XCloseDisplay(dpy);
 	free(selid);
 	cleanup_cfg();
+#endif
 }
 
-static char *
-cistrstr(const char *h, const char *n)
+static int
+utf8len(const char *s, size_t max)
 {
-	size_t i;
-
-	if (!n[0])
-		return (char *)h;
+	unsigned char c = *s;
+	int n = c < 0x80 ? 1 : (c & 0xe0) == 0xc0 ? 2 : (c & 0xf0) == 0xe0 ? 3 :
+	        (c & 0xf8) == 0xf0 ? 4 : 1;
 
-	for (; *h; ++h) {
-		for (i = 0; n[i] && tolower((unsigned char)n[i]) ==
-		            tolower((unsigned char)h[i]); ++i)
-			;
-		if (n[i] == '\0')
-			return (char *)h;
-	}
-	return NULL;
+	return MIN((size_t)n, max);
 }
 
 static void
-drawhighlights(struct item *item, int x, int y, int maxw)
+drawhighlights(unsigned int id, int x, int y, int maxw, int selected)
 {
-	int i, indent;
-	char *highlight;
-	char c;
+	static char *buf;
+	static size_t bufsiz;
+
+	int i, indent, n;
+	char *highlight, *itext = ITEMTEXT(id), *end = itext + itemlen[id];
+	size_t len;
 
-	if (!(strlen(item->text) && strlen(text)))
+	if (!(itemlen[id] && text[0]))
 		return;
 
-	drw_setscheme(drw, scheme[item == sel
+	drw_setscheme(drw, scheme[selected
 	                   ? SchemeSelHighlight
 	                   : SchemeNormHighlight]);
 
-	for (i = 0, highlight = item->text; *highlight && text[i];) {
-		if (!fstrncmp(&text[i], highlight, 1)) {
-			c = highlight[1];
-			highlight[1] = '\0';
+	for (i = 0, highlight = itext; highlight < end && text[i]; highlight += n) {
+		/* pure ASCII items step bytewise, others a whole rune at a time */
+		n = (itemflags[id] & ItemAscii) ? 1 : utf8len(highlight, end - highlight);
+		if (n == 1 ? !fstrncmp(&text[i], highlight, 1) : !strncmp(&text[i], highlight, n)) {
+			/* measured on a copy, the items are shared with the
+			 * thread sorting them */
+			len = highlight + n - itext;
+			if (len >= bufsiz && !(buf = realloc(buf, bufsiz = len + 1)))
+				die("cannot realloc %zu bytes:", bufsiz);
+			memcpy(buf, itext, len);
+			buf[len] = '\0';
 
 			/* get indentation */
-			indent = TEXTW(item->text) + border_padding - 1;
+			indent = TEXTW(buf) + border_padding - 1;
 
 			/* highlight character */
 			drw_text(
 				drw,
 				x + indent - lrpad,
 				y,
-				MIN(maxw - indent, TEXTW(highlight) - lrpad),
-				bh, 0, highlight, 0
+				MIN(maxw - indent, TEXTW(buf + len - n) - lrpad),
+				bh, 0, buf + len - n, 0
 			);
-			highlight[1] = c;
-			i++;
+			i += n;
 		}
-		highlight++;
 	}
 }
 
 static int
-drawitem(struct item *item, int x, int y, int w)
+drawitem(unsigned int pos, int x, int y, int w)
 {
+	unsigned int id = matches[pos];
 	int r;
-	if (item == sel)
+
+	if (pos == sel)
 		drw_setscheme(drw, scheme[SchemeSel]);
-	else if (issel(item->id))
+	else if (issel(id))
 		drw_setscheme(drw, scheme[SchemeOut]);
 	else
 		drw_setscheme(drw, scheme[SchemeNorm]);
 
-	r = drw_text(drw, x, y, w, bh, lrpad / 2, item->text, 0);
-	drawhighlights(item, x, y, w);
+	r = drw_text(drw, x, y, w, bh, lrpad / 2, itemshow(id), 0);
+	/* highlights are of the matched text, which may not be the one shown,
+	 * and of query characters, which a pattern is not */
+	if ((!showoff || showfield == matchfield) && !regex)
+		drawhighlights(id, x, y, w, pos == sel);
 	return r;
 }
 
+/* a query token as the planner sees it: the test, and its rank, the cost
+ * of the test over the chance it rejects an item */
+enum { TermFind, TermPrefix, TermSuffix, TermEqual };
+struct term {
+	char *s;
+	size_t len;
+	int kind, neg, pos;
+	double rank;
+};
+
+static unsigned long bytefreq[256], freqbytes; /* over a sample of the items */
+static unsigned int freqitems, freqsampled;
+
+/* counts the bytes of every so many items, again once they have doubled */
+static void
+samplefreq(void)
+{
+	unsigned int k, id, step;
+	const char *s, *end;
+
+	if (freqsampled && nitems < 2 * freqsampled)
+		return;
+	memset(bytefreq, 0, sizeof(bytefreq));
+	freqbytes = freqitems = 0;
+	step = nitems / FREQSAMPLE + 1;
+	for (k = 0; k < nitems; k += step, freqitems++) {
+		id = live ? (liveold + k) % live : k;
+		for (s = ITEMTEXT(id), end = s + itemlen[id]; s < end; s++)
+			bytefreq[(unsigned char)*s]++;
+		freqbytes += itemlen[id];
+	}
+	freqsampled = nitems;
+}
+
+/* how likely byte c of a folded query is at a given place in an item */
+static double
+byteodds(unsigned char c)
+{
+	unsigned long n = bytefreq[c];
+
+	if (!sensitive && c - 'a' < 26u)
+		n += bytefreq[c - 'a' + 'A'];
+	return (n + 1.0) / (freqbytes + 256.0);
+}
+
+/* reads token s into t: !x is an item without x, 'x has x anywhere, ^x
+ * starts with x, x$ ends with it and ^x$ is it. As before, a plain first
+ * token is a prefix and the others are anywhere. Returns whether s used
+ * an operator */
+static int
+parseterm(struct term *t, char *s, int first)
+{
+	char *p = s;
+	int caret = 0, dollar = 0;
+	size_t n;
+
+	if ((t->neg = *p == '!' && p[1]))
+		p++;
+	if (*p == '\'' && p[1]) {
+		p++;
+	} else {
+		if ((caret = *p == '^' && p[1]))
+			p++;
+		n = strlen(p);
+		if ((dollar = n > 1 && p[n - 1] == '$'))
+			p[n - 1] = '\0';
+	}
+	t->kind = caret && dollar ? TermEqual : caret ? TermPrefix :
+	          dollar ? TermSuffix : p == s && first ? TermPrefix : TermFind;
+	t->s = p;
+	t->len = strlen(p);
+	return p != s || dollar;
+}
+
+static int
+compareterm(const void *a, const void *b)
+{
+	const struct term *x = a, *y = b;
+
+	if (x->rank != y->rank)
+		return x->rank < y->rank ? -1 : 1;
+	return x->pos - y->pos;
+}
+
+/* orders the terms so that the cheap tests that reject most items go first:
+ * a term is as likely as its bytes, anywhere in an item of average length
+ * or at one place for the anchored ones */
+static void
+planterms(struct term *t, int n)
+{
+	struct term k;
+	double avg, sel, cost;
+	size_t j;
+	int i, m;
+
+	if (n < 2)
+		return;
+	samplefreq();
+	avg = freqitems ? (double)freqbytes / freqitems : 1;
+	for (i = 0; i < n; i++) {
+		for (sel = 1, j = 0; j < t[i].len; j++)
+			sel *= byteodds(t[i].s[j]);
+		if (t[i].kind == TermFind) {
+			sel = MIN(1, sel * avg);
+			cost = avg;
+		} else {
+			cost = 1;
+		}
+		if (t[i].neg)
+			sel = 1 - sel;
+		t[i].rank = cost / MAX(1 - sel, 1e-9);
+		t[i].pos = i;
+	}
+	/* a few terms, by insertion; qsort(3) may allocate */
+	for (i = 1; i < n; i++) {
+		for (k = t[i], m = i; m && compareterm(&t[m - 1], &k) > 0; m--)
+			t[m] = t[m - 1];
+		t[m] = k;
+	}
+}
+
+/* with ACMIN or more terms that may be anywhere, takes them out of t and
+ * returns an automaton that finds them in one pass, want and reject being
+ * the bits of the plain and the negated ones; NULL if they stay terms.
+ * It is only worth it if testing them in turn has to scan an item more
+ * than ACCOST times, which is tried on a sample: the byte frequencies do
+ * not tell how often words come together. Single bytes stay, memchr() finds
+ * them sooner than the automaton, which they would have stop at most bytes.
+ * The automaton folds ASCII letters only, so without -s a query that is
+ * not ASCII stays with the kernels, which fold it by the locale */
+static Ac *
+planac(struct term *t, int *n, uint64_t *want, uint64_t *reject, int ascii)
+{
+	static Ac *ac;
+	static char built[sizeof text];
+	static int icase = -1, useac;
+	char *pats[64];
+	size_t lens[64];
+	uint64_t bit[64], seen;
+	unsigned int k, id, step, scans = 0, sampled = 0;
+	int i, j, b, f[64], np = 0;
+
+	if (!sensitive && !ascii)
+		return NULL;
+	for (i = 0; i < *n; i++)
+		if (t[i].kind == TermFind && t[i].len > 1 && np++ < 64)
+			f[np - 1] = i;
+	if (np < ACMIN || np > 64)
+		return NULL;
+	*want = *reject = 0;
+	for (i = 0; i < np; i++) {
+		/* bits go by place in the query, which the plan does not change */
+		for (b = 0, j = 0; j < np; j++)
+			b += t[f[j]].pos < t[f[i]].pos;
+		bit[i] = (uint64_t)1 << b;
+		*(t[f[i]].neg ? reject : want) |= bit[i];
+		pats[b] = t[f[i]].s;
+		lens[b] = t[f[i]].len;
+	}
+	/* -L matches one line at a time, so the automaton is kept */
+	if (!ac || icase != !sensitive || strcmp(built, text)) {
+		if (!ac)
+			ac = ac_new();
+		ac_build(ac, pats, lens, np, !sensitive);
+		strcpy(built, text);
+		icase = !sensitive;
+		step = nitems / ACSAMPLE + 1;
+		for (k = 0; k < nitems; k += step, sampled++) {
+			id = live ? (liveold + k) % live : k;
+			seen = ac_seen(ac, ITEMTEXT(id), itemlen[id]);
+			/* the finds in turn stop at the first that fails */
+			for (i = 0; i < np; i++) {
+				scans++;
+				if (((seen & bit[i]) != 0) == t[f[i]].neg)
+					break;
+			}
+		}
+		useac = scans > ACCOST * sampled;
+	}
+	if (!useac)
+		return NULL;
+	for (i = 0, j = 0; i < *n; i++)
+		if (t[i].kind != TermFind || t[i].len < 2)
+			t[j++] = t[i];
+	*n = j;
+	return ac;
+}
+
+/* folded byte d of item id, -1 past its end */
+#define SORTKEY(id, d) ((d) < itemlen[(id)] ? sortfold[(unsigned char)ITEMTEXT((id))[(d)]] : -1)
+
+/* multikey quicksort: the items agree on the first d bytes, ordered by
+ * byte d in three parts, the middle one then by byte d + 1. Shared path
+ * prefixes are compared once per part, not once per comparison */
+static void
+sortfolded(unsigned int *a, size_t n, size_t d)
+{
+	size_t lt, gt, i;
+	unsigned int t;
+	int c, v;
+
+	while (n > 1) {
+		v = SORTKEY(a[n / 2], d);
+		for (lt = i = 0, gt = n; i < gt; ) {
+			if ((c = SORTKEY(a[i], d)) < v) {
+				t = a[lt], a[lt++] = a[i], a[i++] = t;
+			} else if (c > v) {
+				t = a[--gt], a[gt] = a[i], a[i] = t;
+			} else {
+				i++;
+			}
+		}
+		sortfolded(a, lt, d);
+		sortfolded(a + gt, n - gt, d);
+		if (v == -1) /* the middle ones are equal */
+			break;
+		a += lt;
+		n = gt - lt;
+		d++;
+	}
+}
+
+static void *
+sorter(void *arg)
+{
+	unsigned int *ids, i;
+	int c;
+
+	for (c = 0; c < 256; c++)
+		sortfold[c] = sensitive ? c : tolower(c);
+	ids = ecalloc(nitems, sizeof(*ids));
+	sortrun = ecalloc(nitems / SORTRUN + 1, sizeof(*sortrun));
+	sortbits = ecalloc(nitems / 64 + 1, sizeof(*sortbits));
+	for (i = 0; i < nitems; i++)
+		ids[i] = i;
+	sortfolded(ids, nitems, 0);
+	pthread_mutex_lock(&sortlock);
+	sorted = ids;
+	pthread_mutex_unlock(&sortlock);
+	return NULL;
+}
+
+/* how item id compares to the folded prefix p of n bytes */
+static int
+compareprefix(unsigned int id, const char *p, size_t n)
+{
+	const unsigned char *s = (unsigned char *)ITEMTEXT(id);
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (i == itemlen[id])
+			return -1;
+		if (sortfold[s[i]] != (unsigned char)p[i])
+			return sortfold[s[i]] - (unsigned char)p[i];
+	}
+	return 0;
+}
+
+/* the items the longest prefix term allows, by binary search of the sorted
+ * index and back in input order; NULL while there is no index, without a
+ * prefix term, or when the run is long enough that a scan in place costs
+ * less than putting it in order again */
+static unsigned int *
+prefixrun(const struct term *t, int n, unsigned int *nrun)
+{
+	const struct term *p = NULL;
+	unsigned int *ids, lo, hi, mid, end, k, w;
+	uint64_t b;
+	int i;
+
+	pthread_mutex_lock(&sortlock);
+	ids = sorted;
+	pthread_mutex_unlock(&sortlock);
+	if (!ids)
+		return NULL;
+	for (i = 0; i < n; i++)
+		if (!t[i].neg && (t[i].kind == TermPrefix || t[i].kind == TermEqual) &&
+		    (!p || t[i].len > p->len))
+			p = &t[i];
+	if (!p)
+		return NULL;
+	for (lo = 0, hi = nitems; lo < hi; )
+		if (compareprefix(ids[mid = lo + (hi - lo) / 2], p->s, p->len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	for (end = nitems; hi < end; )
+		if (compareprefix(ids[mid = hi + (end - hi) / 2], p->s, p->len) <= 0)
+			hi = mid + 1;
+		else
+			end = mid;
+	if (hi - lo > nitems / SORTRUN)
+		return NULL;
+	/* marked in a bitmap and read back in order, the bits left clear */
+	for (k = lo; k < hi; k++)
+		sortbits[ids[k] / 64] |= (uint64_t)1 << ids[k] % 64;
+	for (k = 0, w = 0; w <= nitems / 64; w++) {
+		if (!(b = sortbits[w]))
+			continue;
+		for (sortbits[w] = 0, i = 0; b; b >>= 1, i++)
+			if (b & 1)
+				sortrun[k++] = w * 64 + i;
+	}
+	*nrun = hi - lo;
+	return sortrun;
+}
+
 static void
 recalculatenumbers()
 {
 	if (!show_numbers)
 		return;
 
-	unsigned int numer = 0, denom = 0;
-	struct item *item;
-	if (matchend) {
-		numer++;
-		for (item = matchend; item && item->left; item = item->left)
-			numer++;
-	}
-	for (item = items; item && item->text; item++)
-		denom++;
-	snprintf(numbers, NUMBERSBUFSIZE, "%d/%d", numer, denom);
+	snprintf(numbers, NUMBERSBUFSIZE, "%u/%u", cachedtotal ? cachedtotal : nmatches, nitems);
 }
 
 static void
 drawmenu(void)
 {
-	unsigned int curpos;
-	struct item *item;
+	unsigned int curpos, i;
 	int x = border_margin, y = border_margin + border_padding, w;
-	char *censort;
+	static char censort[sizeof text];
+	size_t n;
 
 	recalculatenumbers();
 
@@ -292,15 +843,15 @@ drawmenu(void)
 	}
 
 	/* draw input field */
-	w = ((lines > 0 || !matches) ? mw - x : inputw) - TEXTW(numbers);
+	w = ((lines > 0 || !nmatches) ? mw - x : inputw) - TEXTW(numbers);
 	drw_setscheme(drw, scheme[SchemeOut]);
 
 	/* draw censor_char if passwd, otherwise draw user input */
 	if (passwd) {
-	        censort = ecalloc(1, sizeof(text));
-		memset(censort, censor_char[0], strlen(text));
+		n = strlen(text);
+		memset(censort, censor_char[0], n);
+		censort[n] = '\0';
 		drw_text(drw, x, y, w, bh, 0, censort, 0);
-		free(censort);
 	} else if (input)
 		drw_text(drw, x, y, w, bh, 0, text, 0);
 
@@ -321,190 +872,508 @@ drawmenu(void)
 
 	y += prompt_offset;
 	/* draw vertical list */
-	for (item = curr; item != next; item = item->right)
-		drawitem(item, x - promptw, y += bh, mw - (border_margin*2));
+	for (i = curr; i < next; i++)
+		drawitem(i, x - promptw, y += bh, mw - (border_margin*2));
 
 
 	drw_map(drw, win, 0, 0, mw, mh);
 }
 
-static void
-grabfocus(void)
+static uint64_t
+scorekey(float score, unsigned int id)
 {
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000  };
-	Window focuswin;
-	int i, revertwin;
+	uint32_t u;
 
-	for (i = 0; i < 100; ++i) {
-		XGetInputFocus(dpy, &focuswin, &revertwin);
-		if (focuswin == win)
-			return;
-		XSetInputFocus(dpy, win, RevertToParent, CurrentTime);
-		nanosleep(&ts, NULL);
-	}
-	die("cannot grab focus");
+	/* map the float onto an unsigned integer with the same ordering, the
+	 * item id in the low bits keeps equal scores in input order */
+	memcpy(&u, &score, sizeof(u));
+	u = (u & 0x80000000u) ? ~u : u | 0x80000000u;
+	return (uint64_t)u << 32 | id;
 }
 
-int
-compare_distance(const void *a, const void *b)
+static float
+keyscore(uint64_t k)
 {
-	struct item *da = *(struct item **) a;
-	struct item *db = *(struct item **) b;
+	uint32_t u = k >> 32;
+	float score;
 
-	if (!db)
-		return 1;
-	if (!da)
-		return -1;
+	u = (u & 0x80000000u) ? u & 0x7fffffffu : ~u;
+	memcpy(&score, &u, sizeof(score));
+	return score;
+}
 
-	return da->distance == db->distance ? 0 : da->distance < db->distance ? -1 : 1;
+/* sized to the items once they are in, so a keystroke allocates nothing */
+static void
+growscores(unsigned int n)
+{
+	if (n <= scoresiz)
+		return;
+	while (n > scoresiz)
+		scoresiz = scoresiz ? scoresiz * 2 : 256;
+	if (!(scores = realloc(scores, scoresiz * sizeof(*scores))) ||
+	    !(scoretmp = realloc(scoretmp, scoresiz * sizeof(*scoretmp))))
+		die("cannot realloc %zu bytes:", scoresiz * sizeof(*scores));
 }
 
-void
-fuzzymatch(void)
-{
-	/* bang - we have so much memory */
-	struct item *it;
-	struct item **fuzzymatches = NULL;
-	char c;
-	int number_of_matches = 0, i, pidx, sidx, eidx;
-	int text_len = strlen(text), itext_len;
-
-	matches = matchend = NULL;
-
-	/* walk through all items */
-	for (it = items; it && it->text; it++) {
-		if (text_len) {
-			itext_len = strlen(it->text);
-			pidx = 0; /* pointer */
-			sidx = eidx = -1; /* start of match, end of match */
-			/* walk through item text */
-			for (i = 0; i < itext_len && (c = it->text[i]); i++) {
-				/* fuzzy match pattern */
-				if (!fstrncmp(&text[pidx], &c, 1)) {
-					if(sidx == -1)
-						sidx = i;
-					pidx++;
-					if (pidx == text_len) {
-						eidx = i;
-						break;
+/* sorts the first n keys in scores, byte by byte from the lowest through
+ * scoretmp, skipping the bytes all keys share; qsort(3) would allocate */
+static void
+sortscores(unsigned int n)
+{
+	unsigned int count[256], i, j, sum;
+	uint64_t *from = scores, *to = scoretmp, *t, k;
+	int shift;
+
+	if (n < 64) {
+		for (i = 1; i < n; i++) {
+			for (k = scores[i], j = i; j && scores[j - 1] > k; j--)
+				scores[j] = scores[j - 1];
+			scores[j] = k;
+		}
+		return;
+	}
+	for (shift = 0; shift < 64; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[from[i] >> shift & 0xff]++;
+		if (count[from[0] >> shift & 0xff] == n)
+			continue;
+		for (sum = 0, i = 0; i < 256; i++) {
+			j = count[i];
+			count[i] = sum;
+			sum += j;
+		}
+		for (i = 0; i < n; i++)
+			to[count[from[i] >> shift & 0xff]++] = from[i];
+		t = from;
+		from = to;
+		to = t;
+	}
+	if (from != scores)
+		memcpy(scores, from, n * sizeof(*scores));
+}
 
-					}
-				}
-			}
-			/* build list of matches */
-			if (eidx != -1) {
-				/* compute distance */
-				/* add penalty if match starts late (log(sidx+2))
-				 * add penalty for long a match without many matching characters */
-				it->distance = log(sidx + 2) + (double)(eidx - sidx - text_len);
-				/* fprintf(stderr, "distance %s %f\n", it->text, it->distance); */
-				appenditem(it, &matches, &matchend);
-				number_of_matches++;
+/* puts the n weighted matches collected in scores, best first, in front
+ * of the unweighted ones, which keep input order and are never sorted */
+static void
+placeweighted(unsigned int n)
+{
+	unsigned int i;
+
+	if (!(nscored = n))
+		return;
+	sortscores(n);
+	memmove(matches + n, matches, nmatches * sizeof(*matches));
+	for (i = 0; i < n; i++)
+		matches[i] = (unsigned int)scores[i];
+	nmatches += n;
+}
+
+/* the first of n ASCII bytes that folds to c, 8 bytes at a time: with
+ * c's 0x20 bit set, or-ing it in folds letters and keeps c; the bytes
+ * that collide with c that way are weeded out one by one */
+static const char *
+asciiscan(const char *s, size_t n, char c)
+{
+	const uint64_t ones = 0x0101010101010101ull, high = ones << 7;
+	const uint64_t fold = (c & 0x20) ? ones * 0x20 : 0, pat = ones * (unsigned char)c;
+	const char *e, *end = s + n;
+	uint64_t w;
+
+	while (s < end) {
+		if (end - s >= 8) {
+			memcpy(&w, s, 8);
+			w = (w | fold) ^ pat;
+			if (!((w - ones) & ~w & high)) {
+				s += 8;
+				continue;
 			}
-		} else {
-			appenditem(it, &matches, &matchend);
 		}
+		for (e = MIN(s + 8, end); s < e; s++)
+			if (ASCIIFOLD(*s) == c)
+				return s;
 	}
+	return NULL;
+}
+
+/* match kernels: bytes as they are (-s), case folded as ASCII for pure
+ * ASCII items and queries, and folded by the locale for everything else */
+#define FOLD(C) (C)
+#define SCAN(S, N, C) memchr((S), (C), (N))
+#define K(name) cs_##name
+#include "match.h"
+#define FOLD(C) ASCIIFOLD(C)
+#define SCAN asciiscan
+#define K(name) ci_##name
+#include "match.h"
+#define FOLD(C) ((char)tolower((unsigned char)(C)))
+#define K(name) lc_##name
+#include "match.h"
+
+/* match set builders, with and without -s */
+#define QFOLD(C) (C)
+#define KERN(name, id) cs_##name
+#define D(name) name##_cs
+#include "match.h"
+#define QFOLD(C) ((char)tolower((unsigned char)(C)))
+#define KERN(name, id) (qascii && (itemflags[(id)] & ItemAscii) ? ci_##name : lc_##name)
+#define D(name) name##_ci
+#include "match.h"
+
+/* -r: items the query, a regular expression, matches anywhere in. An
+ * invalid pattern, as while it is typed, matches nothing; a costly one is
+ * cut off after REGEXBUDGET ms with the matches found so far, which sets
+ * cutshort */
+static int cutshort;
 
-	if (number_of_matches) {
-		/* initialize array with matches */
-		if (!(fuzzymatches = realloc(fuzzymatches, number_of_matches * sizeof(struct item*))))
-			die("cannot realloc %u bytes:", number_of_matches * sizeof(struct item*));
-		for (i = 0, it = matches; it && i < number_of_matches; i++, it = it->right) {
-			fuzzymatches[i] = it;
+static void
+regexmatch(unsigned int from, unsigned int to)
+{
+	static Dfa *dfa;
+	static char compiled[sizeof text];
+	static int built, icase, valid;
+	const char *err;
+	unsigned int id, nweighted = 0;
+	struct timespec start;
+
+	/* -L matches one line at a time, so the pattern is kept */
+	if (!built || icase != !sensitive || strcmp(compiled, text)) {
+		if (!dfa)
+			dfa = dfa_new();
+		valid = dfa_compile(dfa, text, !sensitive, &err);
+		strcpy(compiled, text);
+		icase = !sensitive;
+		built = 1;
+	}
+	nmatches = cutshort = 0;
+	if (!valid)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (id = from; id < to; id++) {
+		if (!((id - from + 1) & 4095) && msince(&start) > REGEXBUDGET) {
+			cutshort = 1;
+			break;
 		}
-		/* sort matches according to distance */
-		qsort(fuzzymatches, number_of_matches, sizeof(struct item*), compare_distance);
-		/* rebuild list of matches */
-		matches = matchend = NULL;
-		for (i = 0, it = fuzzymatches[i];  i < number_of_matches && it && \
-				it->text; i++, it = fuzzymatches[i]) {
-			appenditem(it, &matches, &matchend);
+		if (!dfa_match(dfa, ITEMTEXT(id), itemlen[id]))
+			continue;
+		if (itemprior && itemprior[id] > 0) {
+			growscores(nweighted + 1);
+			scores[nweighted++] = scorekey(-itemprior[id], id);
+		} else {
+			matches[nmatches++] = id;
 		}
-		free(fuzzymatches);
 	}
-	curr = sel = matches;
-	calcoffsets();
+	placeweighted(nweighted);
 }
 
+/* serves a short query from the -q cache, only its top matches are copied
+ * until fullmatch() is needed */
+static int
+qlookup(void)
+{
+	struct qent *e;
+	unsigned int i, k;
+
+	if (strlen(text) >= QCACHEQUERY)
+		return 0;
+	for (k = 0; k < nqcache; k++) {
+		e = &qcache[k];
+		if (e->store != storekey || strncmp(e->query, text, QCACHEQUERY))
+			continue;
+		for (i = 0; i < e->ntop && e->top[i] < nitems; i++)
+			;
+		if (i < e->ntop || e->ntop > e->total)
+			return 0;
+		/* -H priors decay from run to run: the scored matches are put in
+		 * order again, which holds while they all are in the top. Without
+		 * history the top stands as it was stored */
+		i = 0;
+		if (histfile) {
+			if (e->nscored >= e->ntop && e->total > e->ntop)
+				return 0;
+			for (; i < e->nscored; i++)
+				scores[i] = scorekey(e->base[i] - (itemprior ? itemprior[e->top[i]] : 0), e->top[i]);
+			sortscores(e->nscored);
+			for (i = 0; i < e->nscored; i++)
+				matches[i] = (unsigned int)scores[i];
+		}
+		memcpy(matches + i, e->top + i, (e->ntop - i) * sizeof(*matches));
+		nmatches = e->ntop;
+		cachedtotal = e->total > e->ntop ? e->total : 0;
+		e->used = ++qclock;
+		qdirty = 1;
+		return 1;
+	}
+	return 0;
+}
 
+/* remembers the matches of a short query, evicting the least recently
+ * used entry once the cache is full */
 static void
-grabkeyboard(void)
+qstore(void)
 {
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000  };
-	int i;
+	struct qent *e;
+	unsigned int k, lru = 0;
+	size_t len = strlen(text);
 
-	if (embed)
+	if (len >= QCACHEQUERY || qcachesize <= 0)
 		return;
-	/* try to grab keyboard, we may have to wait for another process to ungrab */
-	for (i = 0; i < 1000; i++) {
-		if (XGrabKeyboard(dpy, DefaultRootWindow(dpy), True, GrabModeAsync,
-		                  GrabModeAsync, CurrentTime) == GrabSuccess)
-			return;
-		nanosleep(&ts, NULL);
+	if (nqcache < (unsigned int)qcachesize) {
+		e = &qcache[nqcache++];
+	} else {
+		for (k = 1; k < nqcache; k++)
+			if (qcache[k].used < qcache[lru].used)
+				lru = k;
+		e = &qcache[lru];
+	}
+	memset(e, 0, sizeof(*e));
+	e->store = storekey;
+	e->used = ++qclock;
+	e->total = nmatches;
+	e->ntop = MIN(nmatches, QCACHETOP);
+	e->nscored = MIN(nscored, e->ntop);
+	memcpy(e->query, text, len);
+	memcpy(e->top, matches, e->ntop * sizeof(*matches));
+	for (k = 0; k < e->nscored; k++)
+		e->base[k] = keyscore(scores[k]) + (itemprior ? itemprior[matches[k]] : 0);
+	qdirty = 1;
+}
+
+/* -L: does the line in slot id match the query */
+static int
+matchone(unsigned int id)
+{
+	unsigned int *m = matches, n = nmatches, one;
+	int r;
+
+	matches = &one;
+	matcher(id, id + 1);
+	r = nmatches;
+	matches = m;
+	nmatches = n;
+	return r;
+}
+
+/* -L: matches the lines in both parts of the ring, newest first */
+static void
+livematch(void)
+{
+	unsigned int *m, n = 0, i, end = liveold + nitems;
+
+	m = matches = livebuf + live;
+	matcher(liveold, MIN(end, live));
+	n = nmatches;
+	if (end > live) {
+		matches += n;
+		matcher(0, end - live);
+		matches = m;
+		n += nmatches;
 	}
-	die("cannot grab keyboard");
+	growscores(n);
+	for (i = 0; i < n; i++)
+		scores[i] = (uint64_t)((liveold + live - 1 - matches[i]) % live) << 32 | matches[i];
+	sortscores(n);
+	for (nmatches = n, i = 0; i < n; i++)
+		matches[i] = (unsigned int)scores[i];
 }
 
 static void
 match(void)
 {
-	if (fuzzy) {
-		fuzzymatch();
+	/* -it inserts text before the mode, and the items, are known */
+	if (!matcher)
 		return;
+	/* a new query stops the command, the next one runs once it settles */
+	if (provider && strcmp(text, provquery)) {
+		stopprovider();
+		strcpy(provquery, text);
+		provpending = 1;
+		clock_gettime(CLOCK_MONOTONIC, &provchanged);
 	}
-	static char **tokv = NULL;
-	static int tokn = 0;
-
-	char buf[sizeof text], *s;
-	int i, tokc = 0;
-	size_t len, textsize;
-	struct item *item, *lprefix, *lsubstr, *prefixend, *substrend;
-
-	strcpy(buf, text);
-	/* separate input text into tokens to be matched individually */
-	for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
-		if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
-			die("cannot realloc %zu bytes:", tokn * sizeof *tokv);
-	len = tokc ? strlen(tokv[0]) : 0;
-
-	matches = lprefix = lsubstr = matchend = prefixend = substrend = NULL;
-	textsize = strlen(text) + 1;
-	for (item = items; item && item->text; item++) {
-		for (i = 0; i < tokc; i++)
-			if (!fstrstr(item->text, tokv[i]))
-				break;
-		if (i != tokc) /* not all tokens match */
-			continue;
-		/* prefixes go first, then exact matches, ignore substrings */
-		if (!tokc || !fstrncmp(text, item->text, textsize))
-			appenditem(item, &lprefix, &prefixend);
-		else if (!fstrncmp(tokv[0], item->text, len))
-			appenditem(item, &lprefix, &prefixend);
-		// disable substrings
-		//else
-			//appenditem(item, &lsubstr, &substrend);
-	}
-	if (lprefix) {
-		if (matches) {
-			matchend->right = lprefix;
-			lprefix->left = matchend;
-		} else
-			matches = lprefix;
-		matchend = prefixend;
-	}
-	if (lsubstr) {
-		if (matches) {
-			matchend->right = lsubstr;
-			lsubstr->left = matchend;
-		} else
-			matches = lsubstr;
-		matchend = substrend;
-	}
-	curr = sel = matches;
+	cachedtotal = 0;
+	if (live) {
+		livematch();
+	} else if (!qcache || !qlookup()) {
+		matcher(0, nitems);
+		/* a result cut short would stand in for the whole one */
+		if (qcache && !cutshort)
+			qstore();
+	}
+	curr = sel = 0;
+	calcoffsets();
+}
+
+/* replaces a cached top by the whole match set, keeping the selection */
+static void
+fullmatch(void)
+{
+	unsigned int c = curr, s = sel;
+
+	cachedtotal = 0;
+	matcher(0, nitems);
+	curr = c;
+	sel = s;
 	calcoffsets();
 }
 
+static const char *
+histnum(const char *p, const char *end, int64_t *n)
+{
+	for (*n = 0; p < end && (unsigned char)(*p - '0') < 10; p++)
+		*n = *n * 10 + (*p - '0');
+	return p;
+}
+
+/* every use counts, and the count halves with each half-life since the
+ * entry was last used */
+static float
+frecency(uint32_t count, int64_t t, time_t now)
+{
+	return count * exp2(-(double)MAX(now - t, 0) / (MAX(histhalflife, 1) * 86400.0));
+}
+
+static void
+growhist(void)
+{
+	if (nhist < histcap)
+		return;
+	histcap = histcap ? histcap * 2 : 64;
+	if (!(hist = realloc(hist, histcap * sizeof(*hist))))
+		die("cannot realloc %zu bytes:", histcap * sizeof(*hist));
+}
+
+/* counts a use of s, which has to stay valid until writehistory() */
+static void
+histadd(const char *s, size_t len)
+{
+	unsigned int k;
+
+	/* the file holds one entry per line */
+	if (!len || memchr(s, '\n', len))
+		return;
+	for (k = 0; k < nhist; k++)
+		if (hist[k].len == len && !memcmp(hist[k].s, s, len))
+			break;
+	if (k == nhist) {
+		growhist();
+		hist[nhist++] = (struct hist){ s, len, 0, 0, 0 };
+	}
+	hist[k].count++;
+	hist[k].time = time(NULL);
+	hist[k].weight = frecency(hist[k].count, hist[k].time, hist[k].time);
+}
+
+static int
+compare_hist(const void *a, const void *b)
+{
+	float wa = ((const struct hist *)a)->weight, wb = ((const struct hist *)b)->weight;
+
+	return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+/* rewrites the history most frecent first and capped at histsize entries */
+static void
+writehistory(void)
+{
+	char *tmp;
+	FILE *fp;
+	unsigned int k;
+
+	qsort(hist, nhist, sizeof(*hist), compare_hist);
+	if (!(fp = opentemp(histfile, &tmp)))
+		return;
+	for (k = 0; k < nhist && k < (unsigned int)MAX(histsize, 0); k++)
+		fprintf(fp, "%u\t%lld\t%.*s\n", hist[k].count, (long long)hist[k].time,
+		        (int)hist[k].len, hist[k].s);
+	closetemp(fp, tmp, histfile);
+}
+
+/* -x: runs each selected line as dmenu_run did, through $SHELL, in a
+ * session of its own with stdio on /dev/null and not waited for */
+static void
+spawn(char *cmds, size_t len)
+{
+	extern char **environ;
+	char *argv[] = { NULL, "-c", NULL, NULL }, *sh, *p, *end = cmds + len;
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	pid_t pid;
+
+	if (!(sh = getenv("SHELL")) || !*sh)
+		sh = "/bin/sh";
+	argv[0] = sh;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_adddup2(&fa, 1, 2);
+	posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_SETSID
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+#else
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+#endif
+	/* the buffer of open_memstream(3) ends in a NUL past len */
+	for (; cmds < end; cmds = p + 1) {
+		if (!(p = memchr(cmds, outsep, end - cmds)))
+			p = end;
+		*p = '\0';
+		if (p == cmds)
+			continue;
+		argv[2] = cmds;
+		if ((errno = posix_spawn(&pid, sh, &fa, &attr, argv, environ)))
+			fprintf(stderr, "dmenu: cannot run %s: %s\n", cmds, strerror(errno));
+	}
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+}
+
+/* the caller goes on once stdout is closed and the user once the window
+ * is gone, so both come before anything else; a selection is recorded,
+ * then run with -x while the server takes the window down */
+static void
+quit(int status)
+{
+	if (out != stdout)
+		fclose(out);
+	fclose(stdout);
+	XUngrabKeyboard(dpy, CurrentTime);
+	XUnmapWindow(dpy, win);
+	XFlush(dpy);
+	if (!status && histfile)
+		writehistory();
+	/* -c: the command and its pipe are not for the children */
+	stopprovider();
+	if (!status && execute)
+		spawn(runbuf, runlen);
+	cleanup();
+	exit(status);
+}
+
+static void
+printitem(unsigned int id)
+{
+	if (print_index)
+		fprintf(out, "%u%c", ITEMID(id), outsep);
+	else if (outoff) {
+		fwrite(arena + outoff[id], 1, outlen[id], out);
+		fputc(outsep, out);
+	} else {
+		fwrite(ITEMTEXT(id), 1, itemlen[id], out);
+		fputc(outsep, out);
+	}
+	if (histfile)
+		histadd(ITEMTEXT(id), itemlen[id]);
+}
+
+static void
+printinput(void)
+{
+	fprintf(out, "%s%c", print_index ? "-1" : text, outsep);
+	if (histfile)
+		histadd(text, strlen(text));
+}
+
 static void
 insert(const char *str, ssize_t n)
 {
@@ -613,26 +1482,25 @@ keypress(XKeyEvent *ev)
 			goto draw;
 		case XK_Return:
 		case XK_KP_Enter:
-		if(multiselect > 0) {
-			if (sel && issel(sel->id)) {
+		if(multiselect > 0 && nmatches) {
+			if (issel(matches[sel])) {
 				for (int i = 0;i < selidsize;i++)
-					if (selid[i] == sel->id)
+					if (selid[i] == matches[sel])
 						selid[i] = -1;
 			} else {
 				for (int i = 0;i < selidsize;i++)
 					if (selid[i] == -1) {
-						selid[i] = sel->id;
+						selid[i] = matches[sel];
 						return;
 					}
 				selidsize++;
 				selid = realloc(selid, (selidsize + 1) * sizeof(int));
-				selid[selidsize - 1] = sel->id;
+				selid[selidsize - 1] = matches[sel];
 			}
 		}
 			break;
 		case XK_bracketleft:
-			cleanup();
-			exit(1);
+			quit(1);
 		default:
 			return;
 		}
@@ -655,7 +1523,17 @@ keypress(XKeyEvent *ev)
 		}
 	}
 
-	switch(ksym) {
+	/* the selection may leave a cached top of the matches */
+	if (cachedtotal)
+		switch (ksym) {
+		case XK_End:  case XK_KP_End:
+		case XK_Next: case XK_KP_Next:
+		case XK_Down: case XK_KP_Down:
+		case XK_Right: case XK_KP_Right:
+			fullmatch();
+		}
+
+	switch(ksym) {
 	default:
 insert:
 		if (!iscntrl((unsigned char)*buf))
@@ -678,32 +1556,34 @@ insert:
 			cursor = strlen(text);
 			break;
 		}
-		if (next) {
+		if (next < nmatches) {
 			/* jump to end of list and position items in reverse */
-			curr = matchend;
+			curr = nmatches - 1;
 			calcoffsets();
 			curr = prev;
 			calcoffsets();
-			while (next && (curr = curr->right))
+			while (next < nmatches && curr + 1 < nmatches) {
+				curr++;
 				calcoffsets();
+			}
 		}
-		sel = matchend;
+		sel = nmatches ? nmatches - 1 : 0;
 		break;
 	case XK_Escape:
-		cleanup();
-		exit(1);
+		quit(1);
+		break;
 	case XK_Home:
 	case XK_KP_Home:
-		if (sel == matches) {
+		if (sel == 0) {
 			cursor = 0;
 			break;
 		}
-		sel = curr = matches;
+		sel = curr = 0;
 		calcoffsets();
 		break;
 	case XK_Left:
 	case XK_KP_Left:
-		if (cursor > 0 && (!sel || !sel->left || lines > 0)) {
+		if (cursor > 0 && (sel == 0 || lines > 0)) {
 			cursor = nextrune(-1);
 			break;
 		}
@@ -712,21 +1592,21 @@ insert:
 		/* fallthrough */
 	case XK_Up:
 	case XK_KP_Up:
-		if (sel && sel->left && (sel = sel->left)->right == curr) {
+		if (sel > 0 && sel-- == curr) {
 			curr = prev;
 			calcoffsets();
 		}
 		break;
 	case XK_Next:
 	case XK_KP_Next:
-		if (!next)
+		if (next >= nmatches)
 			return;
 		sel = curr = next;
 		calcoffsets();
 		break;
 	case XK_Prior:
 	case XK_KP_Prior:
-		if (!prev)
+		if (!nmatches)
 			return;
 		sel = curr = prev;
 		calcoffsets();
@@ -736,16 +1616,15 @@ insert:
 		if (!(ev->state & ControlMask)) {
 			/* multi-select items */
 			for (int i = 0;i < selidsize;i++)
-				if (selid[i] != -1 && (!sel || sel->id != selid[i]))
-					print_index ? printf("%d\n", items[selid[i]].id) : puts(items[selid[i]].text);
+				if (selid[i] != -1 && (!nmatches || matches[sel] != selid[i]))
+					printitem(selid[i]);
 			/* item that is currently under selection */
-			if (sel && !(ev->state & ShiftMask))
-				print_index ? printf("%d\n", sel->id) : puts(sel->text);
+			if (nmatches && !(ev->state & ShiftMask))
+				printitem(matches[sel]);
 			else
 				/* input from the textbox */
-				puts(print_index ? "-1" : text);
-			cleanup();
-			exit(0);
+				printinput();
+			quit(0);
 		}
 		break;
 	case XK_Right:
@@ -759,29 +1638,29 @@ insert:
 		/* fallthrough */
 	case XK_Down:
 	case XK_KP_Down:
-		if (sel && sel->right && (sel = sel->right) == next) {
+		if (sel + 1 < nmatches && ++sel == next) {
 			curr = next;
 			calcoffsets();
 		}
 		break;
 	case XK_Tab:
-		if (!sel)
+		if (!nmatches)
 			return;
-		cursor = strnlen(sel->text, sizeof text - 1);
-		memcpy(text, sel->text, cursor);
+		cursor = MIN(itemlen[matches[sel]], sizeof text - 1);
+		memcpy(text, ITEMTEXT(matches[sel]), cursor);
 		text[cursor] = '\0';
 		match();
 		break;
 	}
 
 draw:
-	drawmenu();
+	redraw = 1;
 }
 
 static void
 buttonpress(XEvent *e)
 {
-	struct item *item;
+	unsigned int i;
 	XButtonPressedEvent *ev = &e->xbutton;
 
 	int x = border_padding + border_margin, y = border_margin + border_padding + prompt_offset, h = bh, w;
@@ -791,44 +1670,46 @@ buttonpress(XEvent *e)
 
 	/* right-click: exit */
 	if (ev->button == Button3)
-		exit(1);
+		quit(1);
 
 	if (prompt && *prompt)
 		x += promptw;
 
 	/* input field */
-	w = (lines > 0 || !matches) ? mw - x : inputw;
+	w = (lines > 0 || !nmatches) ? mw - x : inputw;
 
 	/* left-click on input: clear input,
 	 * NOTE: if there is no left-arrow the space for < is reserved so
 	 *       add that to the input width */
 	if (ev->button == Button1 &&
 	   ((lines <= 0 && ev->x >= 0 && ev->x <= x + w +
-	   ((!prev || !curr->left) ? TEXTW("<") : 0)) ||
+	   ((!nmatches || curr == 0) ? TEXTW("<") : 0)) ||
 	   (lines > 0 && ev->y >= y && ev->y <= y + h))) {
 		insert(NULL, -cursor);
-		drawmenu();
+		redraw = 1;
 		return;
 	}
 	/* middle-mouse click: paste selection */
 	if (ev->button == Button2) {
 		XConvertSelection(dpy, (ev->state & ShiftMask) ? clip : XA_PRIMARY,
 		                  utf8, utf8, win, CurrentTime);
-		drawmenu();
+		redraw = 1;
 		return;
 	}
 	/* scroll up */
-	if (ev->button == Button4 && prev) {
+	if (ev->button == Button4 && nmatches) {
 		sel = curr = prev;
 		calcoffsets();
-		drawmenu();
+		redraw = 1;
 		return;
 	}
-	/* scroll down */
-	if (ev->button == Button5 && next) {
+	/* scroll down, past a cached top too */
+	if (ev->button == Button5 && cachedtotal)
+		fullmatch();
+	if (ev->button == Button5 && next < nmatches) {
 		sel = curr = next;
 		calcoffsets();
-		drawmenu();
+		redraw = 1;
 		return;
 	}
 	if (ev->button != Button1)
@@ -838,39 +1719,36 @@ buttonpress(XEvent *e)
 
 	/* vertical list: (ctrl)left-click on item */
 	w = mw - x;
-	for (item = curr; item != next; item = item->right) {
+	for (i = curr; i < next; i++) {
 		y += h;
 		if (ev->y >= y && ev->y <= (y + h)) {
 			if(multiselect || !(ev->state & ControlMask)) {
-				sel = item;
-				if (sel) {
-					if (sel && issel(sel->id)) {
-						for (int i = 0;i < selidsize;i++)
-							if (selid[i] == sel->id)
-								selid[i] = -1;
-					} else {
-						for (int i = 0;i < selidsize;i++)
-							if (selid[i] == -1) {
-								selid[i] = sel->id;
-								return;
-							}
-						selidsize++;
-						selid = realloc(selid, (selidsize + 1) * sizeof(int));
-						selid[selidsize - 1] = sel->id;
-					}
-					drawmenu();
+				sel = i;
+				if (issel(matches[sel])) {
+					for (int i = 0;i < selidsize;i++)
+						if (selid[i] == matches[sel])
+							selid[i] = -1;
+				} else {
+					for (int i = 0;i < selidsize;i++)
+						if (selid[i] == -1) {
+							selid[i] = matches[sel];
+							return;
+						}
+					selidsize++;
+					selid = realloc(selid, (selidsize + 1) * sizeof(int));
+					selid[selidsize - 1] = matches[sel];
 				}
+				redraw = 1;
 			}
 			if (!(ev->state & ControlMask)) {
 				for (int i = 0;i < selidsize;i++)
-					if (selid[i] != -1 && (!sel || sel->id != selid[i]))
-						puts(items[selid[i]].text);
-				if (sel && !(ev->state & ShiftMask))
-					puts(sel->text);
+					if (selid[i] != -1 && (!nmatches || matches[sel] != selid[i]))
+						printitem(selid[i]);
+				if (nmatches && !(ev->state & ShiftMask))
+					printitem(matches[sel]);
 				else
-					puts(text);
-				cleanup();
-				exit(0);
+					printinput();
+				quit(0);
 			}
 			return;
 		}
@@ -893,47 +1771,946 @@ paste(void)
 		insert(p, (q = strchr(p, '\n')) ? q - p : (ssize_t)strlen(p));
 		XFree(p);
 	}
-	drawmenu();
+	redraw = 1;
+}
+
+static void *
+heapcopy(const void *p, size_t len, size_t siz)
+{
+	void *q = ecalloc(MAX(siz, 1), 1);
+
+	memcpy(q, p, len);
+	return q;
+}
+
+/* a mapped store is copied to the heap before anything is added to it */
+static void
+unmapstore(void)
+{
+	if (indexmapped) {
+		itemsiz = nitems;
+		itemoff = heapcopy(itemoff, nitems * sizeof(*itemoff), itemsiz * sizeof(*itemoff));
+		itemlen = heapcopy(itemlen, nitems * sizeof(*itemlen), itemsiz * sizeof(*itemlen));
+		itemflags = heapcopy(itemflags, nitems, itemsiz);
+	}
+	if (arenamapped)
+		arena = heapcopy(arena, arenalen, arenasiz = arenalen);
+	munmap(map, mapsiz);
+	map = NULL;
+	arenamapped = indexmapped = 0;
+}
+
+static void
+additem(const char *s, size_t len)
+{
+	unsigned char ascii = 0;
+	size_t i;
+
+	if (indexmapped || (arenamapped && (s < arena || s >= arena + arenalen)))
+		unmapstore();
+	if (nitems >= itemsiz) {
+		itemsiz = itemsiz ? itemsiz * 2 : 256;
+		if (!(itemoff = realloc(itemoff, itemsiz * sizeof(*itemoff))) ||
+		    !(itemlen = realloc(itemlen, itemsiz * sizeof(*itemlen))) ||
+		    !(itemflags = realloc(itemflags, itemsiz * sizeof(*itemflags))) ||
+		    (dedup && !(itemid = realloc(itemid, itemsiz * sizeof(*itemid)))) ||
+		    (weighted && !(itemprior = realloc(itemprior, itemsiz * sizeof(*itemprior)))) ||
+		    (fielddelim && (!(showoff = realloc(showoff, itemsiz * sizeof(*showoff))) ||
+		     !(showlen = realloc(showlen, itemsiz * sizeof(*showlen))) ||
+		     !(outoff = realloc(outoff, itemsiz * sizeof(*outoff))) ||
+		     !(outlen = realloc(outlen, itemsiz * sizeof(*outlen))))))
+			die("cannot realloc %zu bytes:", itemsiz * sizeof(*itemoff));
+	}
+	for (i = 0; i < len; i++)
+		ascii |= s[i];
+	itemflags[nitems] = ascii < 0x80 ? ItemAscii : 0;
+	itemlen[nitems] = len;
+
+	if (arenamapped) { /* text is already in place */
+		itemoff[nitems++] = s - arena;
+		return;
+	}
+	if (arenalen + len + 1 > arenasiz) {
+		/* offsets are 32-bit, which bounds the arena at 4 GiB */
+		if (arenalen + len + 1 > UINT32_MAX)
+			die("input too large");
+		while (arenalen + len + 1 > arenasiz)
+			arenasiz = arenasiz ? arenasiz * 2 : BUFSIZ * 16;
+		arenasiz = MIN(arenasiz, UINT32_MAX);
+		if (!(arena = realloc(arena, arenasiz)))
+			die("cannot realloc %zu bytes:", arenasiz);
+	}
+	memcpy(arena + arenalen, s, len);
+	arena[arenalen + len] = '\0';
+	itemoff[nitems++] = arenalen;
+	arenalen += len + 1;
+}
+
+static uint32_t
+hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u; /* FNV-1a */
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+/* the slot of the item with this text, or the free slot it would take */
+static unsigned int
+hslot(const char *s, size_t len, uint32_t h)
+{
+	unsigned int i, id;
+
+	for (i = h & (hsiz - 1); htab[i].id; i = (i + 1) & (hsiz - 1)) {
+		id = htab[i].id - 1;
+		if (htab[i].hash == h && itemlen[id] == len && !memcmp(ITEMTEXT(id), s, len))
+			break;
+	}
+	return i;
+}
+
+/* returns 1 if an item with this text exists, otherwise remembers the text
+ * under the id the next additem() will use */
+static int
+dupitem(const char *s, size_t len)
+{
+	struct hent *old = htab;
+	unsigned int i, j, osiz = hsiz;
+	uint32_t h = hash(s, len);
+
+	if (nitems * 2 >= hsiz) {
+		hsiz = hsiz ? hsiz * 2 : 1024;
+		htab = ecalloc(hsiz, sizeof(*htab));
+		for (j = 0; j < osiz; j++) {
+			if (!old[j].id)
+				continue;
+			for (i = old[j].hash & (hsiz - 1); htab[i].id; i = (i + 1) & (hsiz - 1))
+				;
+			htab[i] = old[j];
+		}
+		free(old);
+	}
+	if (htab[i = hslot(s, len, h)].id)
+		return 1;
+	htab[i].id = nitems + 1;
+	htab[i].hash = h;
+	return 0;
+}
+
+static uint32_t
+le32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+
+	return u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+/* -t: splits a leading "weight<TAB>" column off a record, records without
+ * one keep their text and weigh nothing */
+static const char *
+weightcol(const char *s, size_t *len, float *w)
+{
+	const char *p = s, *end = s + *len;
+	double v = 0, f = 1;
+
+	for (; p < end && (unsigned char)(*p - '0') < 10; p++)
+		v = v * 10 + (*p - '0');
+	if (p < end && *p == '.')
+		for (p++; p < end && (unsigned char)(*p - '0') < 10; p++)
+			v += (*p - '0') * (f /= 10);
+	if (p == s || p == end || *p != '\t')
+		return s;
+	*w = v;
+	*len = end - p - 1;
+	return p + 1;
+}
+
+/* -L: drops the oldest line */
+static void
+liveevict(void)
+{
+	unsigned int id = liveold, i;
+
+	if (nmatches && matches[nmatches - 1] == id) {
+		nmatches--;
+		sel = MIN(sel, nmatches ? nmatches - 1 : 0);
+		curr = MIN(curr, sel);
+		feeddirty = 1;
+	}
+	for (i = 0; i < selidsize; i++)
+		if (selid[i] == id)
+			selid[i] = -1;
+	liveold = (liveold + 1) % live;
+	nitems--;
+}
+
+/* -L: adds a line in place of the oldest ones it needs the room of */
+static void
+liveitem(const char *s, size_t len, float w)
+{
+	unsigned char ascii = 0;
+	unsigned int id;
+	size_t i;
+
+	if (nitems == live) {
+		liveevict();
+		livefull = 1;
+	}
+	for (;;) {
+		/* the oldest line goes if it is where this one is written */
+		while (nitems && itemoff[liveold] >= arenalen && itemoff[liveold] < arenalen + len + 1)
+			liveevict();
+		if (arenalen + len + 1 <= arenasiz)
+			break;
+		/* the first live lines size the arena, the rest reuse it */
+		if (!livefull || len + 1 > arenasiz) {
+			arenasiz = MAX(arenasiz ? arenasiz * 2 : BUFSIZ * 16, arenalen + len + 1);
+			if (arenasiz > UINT32_MAX)
+				die("input too large");
+			if (!(arena = realloc(arena, arenasiz)))
+				die("cannot realloc %zu bytes:", arenasiz);
+		} else {
+			arenalen = 0;
+		}
+	}
+	id = (liveold + nitems++) % live;
+	for (i = 0; i < len; i++)
+		ascii |= s[i];
+	itemflags[id] = ascii < 0x80 ? ItemAscii : 0;
+	itemlen[id] = len;
+	itemoff[id] = arenalen;
+	itemid[id] = nrecords;
+	if (itemprior)
+		itemprior[id] = w > 0 ? log2f(1 + w) : 0;
+	memcpy(arena + arenalen, s, len);
+	arena[arenalen + len] = '\0';
+	arenalen += len + 1;
+
+	if (!matchone(id))
+		return;
+	if (matches == livebuf) {
+		memmove(livebuf + live, matches, nmatches * sizeof(*matches));
+		matches = livebuf + live;
+	}
+	*--matches = id;
+	nmatches++;
+	/* the view follows new lines unless the selection moved off them */
+	if (sel) {
+		sel++;
+		curr++;
+	}
+	feeddirty = 1;
+}
+
+/* -d: field n of the record s, 0 being all of it; an empty one at the end
+ * if there are fewer */
+static const char *
+field(const char *s, size_t len, int n, size_t *flen)
+{
+	const char *p, *end = s + len;
+
+	for (; n > 1; n--, s = p + 1)
+		if (!(p = memchr(s, fielddelim, end - s))) {
+			*flen = 0;
+			return end;
+		}
+	*flen = (n && (p = memchr(s, fielddelim, end - s))) ? (size_t)(p - s) : (size_t)(end - s);
+	return s;
+}
+
+static void
+addrecord(const char *s, size_t len)
+{
+	const char *m, *d, *o;
+	size_t mlen, dlen, olen;
+	uint32_t base;
+	float w = 0;
+
+	if (weighted)
+		s = weightcol(s, &len, &w);
+	if (live) {
+		liveitem(s, len, w);
+		nrecords++;
+		return;
+	}
+	if (fielddelim) {
+		m = field(s, len, matchfield, &mlen);
+		d = field(s, len, showfield, &dlen);
+		o = field(s, len, outfield, &olen);
+	} else {
+		m = d = o = s;
+		mlen = dlen = olen = len;
+	}
+	/* with -u only the first occurrence is kept, under its record number;
+	 * without it lines are not hashed, so repeats are not interned */
+	if (!(dedup && dupitem(m, mlen))) {
+		additem(s, len);
+		if (fielddelim) {
+			base = itemoff[nitems - 1];
+			showoff[nitems - 1] = base + (d - s);
+			showlen[nitems - 1] = dlen;
+			outoff[nitems - 1] = base + (o - s);
+			outlen[nitems - 1] = olen;
+			itemoff[nitems - 1] = base + (m - s);
+			itemlen[nitems - 1] = mlen;
+		}
+		if (dedup)
+			itemid[nitems - 1] = nrecords;
+		if (weighted)
+			itemprior[nitems - 1] = w;
+	}
+	nrecords++;
+}
+
+/* -B input that is a regular file is indexed in place: each record is a
+ * 32-bit little-endian length, the text and a terminating NUL, so the
+ * mapping itself serves as the arena */
+static int
+mapframed(int fd)
+{
+	struct stat st;
+	char *p, *end;
+	uint32_t len;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || !st.st_size)
+		return 0;
+	if (st.st_size > UINT32_MAX)
+		die("input too large");
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		return 0;
+	}
+	arena = map;
+	arenamapped = 1;
+	arenalen = arenasiz = mapsiz = st.st_size;
+
+	for (p = arena, end = arena + arenalen; end - p >= 4; p += 4 + len + 1) {
+		len = le32(p);
+		if ((size_t)(end - p) < 4 + (size_t)len + 1 || p[4 + len] != '\0')
+			die("malformed record at byte %zu", (size_t)(p - arena));
+		addrecord(p + 4, len);
+	}
+	if (p != end)
+		die("malformed record at byte %zu", (size_t)(p - arena));
+	return 1;
+}
+
+/* a dmenu_cache index already is an item store, it only gets mapped */
+static void
+readindex(const char *file)
+{
+	struct idxheader h;
+	struct stat st;
+	uint32_t i;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+		die("cannot open %s:", file);
+	if ((size_t)st.st_size < sizeof h)
+		die("%s: not an index", file);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		die("mmap %s:", file);
+	mapsiz = st.st_size;
+	memcpy(&h, map, sizeof h);
+	if (memcmp(h.magic, IDXMAGIC, sizeof h.magic) ||
+	    IDXSIZE(h.nitems, h.bloblen, h.ndirs) > mapsiz)
+		die("%s: not an index", file);
+
+	itemoff = (uint32_t *)(map + sizeof h);
+	itemlen = itemoff + h.nitems;
+	itemflags = (unsigned char *)(itemlen + h.nitems);
+	arena = map + IDXBLOB(h.nitems);
+	/* the matchers trust every text to lie in the blob, NUL-terminated */
+	for (i = 0; i < h.nitems; i++)
+		if (itemoff[i] >= h.bloblen || itemlen[i] >= h.bloblen - itemoff[i] ||
+		    arena[itemoff[i] + itemlen[i]])
+			die("%s: not an index", file);
+	nitems = itemsiz = h.nitems;
+	arenalen = arenasiz = h.bloblen;
+	arenamapped = indexmapped = 1;
+	/* dmenu_cache already dropped duplicates, and there is no weight column */
+	dedup = weighted = 0;
+}
+
+/* reads and adds the records of one chunk of fd; 0 at end of input, -1 if
+ * a non-blocking fd has nothing yet */
+static int
+readitems(int fd)
+{
+	char *p, *q, *end;
+	ssize_t n;
+	uint32_t rlen;
+
+	if (rd.eof)
+		return 0;
+	if (rd.len == rd.siz) {
+		rd.siz = rd.siz ? rd.siz * 2 : BUFSIZ * 16;
+		if (!(rd.buf = realloc(rd.buf, rd.siz)))
+			die("cannot realloc %zu bytes:", rd.siz);
+	}
+	if ((n = read(fd, rd.buf + rd.len, rd.siz - rd.len)) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return -1;
+		die("read:");
+	}
+	if (n == 0) {
+		/* a last line without terminator still counts */
+		if (rd.len && !framed)
+			addrecord(rd.buf, rd.len);
+		else if (rd.len)
+			die("truncated record at end of input");
+		free(rd.buf);
+		rd.buf = NULL;
+		rd.len = rd.siz = 0;
+		rd.eof = 1;
+		return 0;
+	}
+	rd.len += n;
+
+	for (p = rd.buf, end = rd.buf + rd.len; ; ) {
+		if (framed) {
+			if (end - p < 4 || (size_t)(end - p) < 4 + (size_t)(rlen = le32(p)) + 1)
+				break;
+			if (p[4 + rlen] != '\0')
+				die("malformed record");
+			addrecord(p + 4, rlen);
+			p += 4 + rlen + 1;
+		} else {
+			if (!(q = memchr(p, delim, end - p)))
+				break;
+			addrecord(p, q - p);
+			p = q + 1;
+		}
+	}
+	memmove(rd.buf, p, rd.len = end - p);
+	return 1;
+}
+
+/* maps the history file, a missing one is an empty history; lines in the
+ * older "count<TAB>text" format count as last used when the file was */
+static void
+loadhistory(void)
+{
+	struct stat st;
+	const char *p, *q, *t, *end;
+	int64_t count, tm;
+	time_t now = time(NULL);
+	int fd;
+
+	if ((fd = open(histfile, O_RDONLY)) == -1)
+		return;
+	if (fstat(fd, &st) == -1 || !st.st_size ||
+	    (histmap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		histmap = NULL;
+		close(fd);
+		return;
+	}
+	close(fd);
+	histmapsiz = st.st_size;
+
+	for (p = histmap, end = histmap + histmapsiz; p < end; p = q + 1) {
+		if (!(q = memchr(p, '\n', end - p)))
+			q = end;
+		if ((t = histnum(p, q, &count)) == p || t == q || *t != '\t')
+			continue;
+		p = t + 1;
+		if ((t = histnum(p, q, &tm)) != p && t < q && *t == '\t')
+			p = t + 1;
+		else
+			tm = st.st_mtime;
+		if (p == q)
+			continue;
+		growhist();
+		hist[nhist++] = (struct hist){ p, q - p, count, tm, frecency(count, tm, now) };
+	}
+}
+
+/* adds each history entry's weight to its item's prior; entries that
+ * match no item, say a command with arguments, are added as items */
+static void
+mergehistory(void)
+{
+	unsigned int i, k, id, siz, *slot;
+	uint32_t *item; /* item id + 1 of each entry, 0 if none */
+
+	item = ecalloc(nhist, sizeof(*item));
+	if (htab) {
+		/* -u already hashed every item */
+		for (k = 0; k < nhist; k++)
+			item[k] = htab[hslot(hist[k].s, hist[k].len, hash(hist[k].s, hist[k].len))].id;
+	} else {
+		/* hash the entries and look each item up among them */
+		for (siz = 64; siz < nhist * 2; siz *= 2)
+			;
+		slot = ecalloc(siz, sizeof(*slot));
+		for (k = 0; k < nhist; k++) {
+			for (i = hash(hist[k].s, hist[k].len) & (siz - 1); slot[i]; i = (i + 1) & (siz - 1))
+				;
+			slot[i] = k + 1;
+		}
+		for (id = 0; id < nitems; id++)
+			for (i = hash(ITEMTEXT(id), itemlen[id]) & (siz - 1); (k = slot[i]); i = (i + 1) & (siz - 1))
+				if (!item[k - 1] && hist[k - 1].len == itemlen[id] &&
+				    !memcmp(hist[k - 1].s, ITEMTEXT(id), itemlen[id]))
+					item[k - 1] = id + 1;
+		free(slot);
+	}
+	/* entries without an item become one, but not without -d fields */
+	for (k = 0; k < nhist; k++) {
+		if (item[k] || fielddelim)
+			continue;
+		id = nitems;
+		addrecord(hist[k].s, hist[k].len);
+		if (nitems > id)
+			item[k] = nitems;
+	}
+
+	/* with -t the priors already hold the weight column */
+	if (!itemprior)
+		itemprior = ecalloc(nitems, sizeof(*itemprior));
+	for (k = 0; k < nhist; k++)
+		if (item[k])
+			itemprior[item[k] - 1] += hist[k].weight;
+	free(item);
+}
+
+static uint64_t
+hash64(const void *p, size_t len, uint64_t h)
+{
+	const unsigned char *s = p;
+	uint64_t w;
+
+	for (; len >= 8; s += 8, len -= 8) {
+		memcpy(&w, s, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 32;
+	}
+	while (len--)
+		h = (h ^ *s++) * 0x100000001b3ull;
+	return h;
+}
+
+/* reads the -q cache, a missing or foreign file is an empty cache */
+static void
+loadqcache(void)
+{
+	struct qheader h;
+	unsigned int k;
+	FILE *fp;
+
+	/* entries are only good for this very store and matching mode, and
+	 * with -d for the field matched */
+	storekey = hash64(arena, arenalen, storekey ^ (fuzzy | sensitive << 1 | regex << 2 |
+	                  (unsigned char)fielddelim << 3 | (uint64_t)matchfield << 11));
+	storekey = hash64(&nitems, sizeof(nitems), storekey);
+	if (itemid)
+		storekey = hash64(itemid, nitems * sizeof(*itemid), storekey);
+	/* which items have a prior, not how much: that changes with -H */
+	if (itemprior)
+		for (k = 0; k < nitems; k++)
+			if (itemprior[k] > 0)
+				storekey = hash64(&k, sizeof(k), storekey);
+
+	qcache = ecalloc(MAX(qcachesize, 1), sizeof(*qcache));
+	if (!(fp = fopen(qcachefile, "r")))
+		return;
+	if (fread(&h, sizeof(h), 1, fp) == 1 && !memcmp(h.magic, QCACHEMAGIC, sizeof(h.magic)))
+		nqcache = fread(qcache, sizeof(*qcache), MIN(h.n, (unsigned int)MAX(qcachesize, 0)), fp);
+	fclose(fp);
+	for (k = 0; k < nqcache; k++)
+		qclock = MAX(qclock, qcache[k].used);
+}
+
+static void
+startprovider(void)
+{
+	extern char **environ;
+	char *argv[] = { "sh", "-c", (char *)provider, "sh", provquery, NULL };
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	int fd[2];
+
+	provpending = 0;
+	if (pipe(fd) == -1)
+		die("pipe:");
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&fa, fd[1], 1);
+	posix_spawn_file_actions_addclose(&fa, fd[0]);
+	posix_spawn_file_actions_addclose(&fa, fd[1]);
+	posix_spawnattr_init(&attr);
+	/* a group of its own, stopping it stops its whole pipeline */
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+	errno = posix_spawn(&provpid, "/bin/sh", &fa, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+	close(fd[1]);
+	if (errno) {
+		fprintf(stderr, "dmenu: cannot run %s: %s\n", provider, strerror(errno));
+		close(fd[0]);
+		provpid = 0;
+		return;
+	}
+	feedfd = fd[0];
+	fcntl(feedfd, F_SETFL, O_NONBLOCK);
+	fcntl(feedfd, F_SETFD, FD_CLOEXEC);
+	provfresh = 1;
+	rd.len = rd.eof = 0;
+}
+
+static void
+stopprovider(void)
+{
+	if (provpid)
+		kill(-provpid, SIGTERM);
+	if (feedfd != -1)
+		close(feedfd);
+	feedfd = -1;
+	provpid = 0;
+	/* reap whatever exited, without waiting for the rest */
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+}
+
+/* -c: the first output of a command replaces the items */
+static void
+clearitems(void)
+{
+	nitems = nrecords = 0;
+	arenalen = 0;
+	if (htab)
+		memset(htab, 0, hsiz * sizeof(*htab));
+	selidsize = 0; /* selections were of the old items */
+	/* and so were the matches, until the next match() there are none */
+	curr = sel = 0;
+	nmatches = cachedtotal = 0;
+	calcoffsets();
+	freqsampled = 0;
 }
 
 static void
 readstdin(void)
 {
-	char *line = NULL;
-	size_t i, itemsiz = 0, linesiz = 0;
-	ssize_t len;
+	unsigned int i;
 
 	if (passwd) {
 		inputw = lines = 0;
+		qcachefile = NULL;
 		return;
  	}
+	if (live) {
+		/* lines come in while the menu runs; history only records */
+		if (histfile)
+			loadhistory();
+		itemsiz = matchsiz = live;
+		itemoff = ecalloc(live, sizeof(*itemoff));
+		itemlen = ecalloc(live, sizeof(*itemlen));
+		itemflags = ecalloc(live, sizeof(*itemflags));
+		itemid = ecalloc(live, sizeof(*itemid));
+		if (weighted)
+			itemprior = ecalloc(live, sizeof(*itemprior));
+		matches = livebuf = ecalloc(2 * live, sizeof(*livebuf));
+		matches += live;
+		feedfd = 0;
+		return;
+	}
+	if (provider) {
+		/* items come in while the menu runs; history only records */
+		if (histfile)
+			loadhistory();
+		strcpy(provquery, text);
+		startprovider();
+		return;
+	}
 
-	/* read each line from stdin and add it to the item list */
-	for (i = 0; (len = getline(&line, &linesiz, stdin)) != -1; i++) {
-		if (i + 1 >= itemsiz) {
-			itemsiz += 256;
-			if (!(items = realloc(items, itemsiz * sizeof(*items))))
-				die("cannot realloc %zu bytes:", itemsiz * sizeof(*items));
+	if (indexfile)
+		readindex(indexfile);
+	else if (!(framed && mapframed(0)))
+		while (readitems(0))
+			;
+	/* the -q key holds the weight column, but not the history over it */
+	if (qcachefile && itemprior)
+		storekey = hash64(itemprior, nitems * sizeof(*itemprior), 0);
+	if (histfile) {
+		loadhistory();
+		if (nhist)
+			mergehistory();
+	}
+	/* weights turn into a score bonus once, the matchers only subtract it */
+	if (itemprior)
+		for (i = 0; i < nitems; i++)
+			if (itemprior[i] > 0)
+				itemprior[i] = log2f(1 + itemprior[i]);
+	if (qcachefile)
+		loadqcache();
+
+	/* drop the growth slack, the store does not change after this */
+	if (nitems && !indexmapped) {
+		if (!arenamapped)
+			arena = realloc(arena, arenasiz = arenalen);
+		itemoff = realloc(itemoff, (itemsiz = nitems) * sizeof(*itemoff));
+		itemlen = realloc(itemlen, nitems * sizeof(*itemlen));
+		itemflags = realloc(itemflags, nitems * sizeof(*itemflags));
+		if (itemid)
+			itemid = realloc(itemid, nitems * sizeof(*itemid));
+		if (itemprior)
+			itemprior = realloc(itemprior, nitems * sizeof(*itemprior));
+		if (fielddelim) {
+			showoff = realloc(showoff, nitems * sizeof(*showoff));
+			showlen = realloc(showlen, nitems * sizeof(*showlen));
+			outoff = realloc(outoff, nitems * sizeof(*outoff));
+			outlen = realloc(outlen, nitems * sizeof(*outlen));
 		}
-		if (line[len - 1] == '\n')
-			line[len - 1] = '\0';
-		if (!(items[i].text = strdup(line)))
-			die("strdup:");
+	}
+	if (nitems)
+		matches = ecalloc(nitems, sizeof(*matches));
+	growscores(nitems);
+	lines = MIN(lines, nitems);
+	/* prefix terms narrow the items by a sorted index, built meanwhile */
+	if (nitems >= SORTMIN && !fuzzy && !regex &&
+	    !(errno = pthread_create(&sortthread, NULL, sorter, NULL)))
+		sorting = 1;
+}
+
+static long
+msince(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/* sleeps until deadline ms after start or until X events come in, which
+ * may be what was waited for */
+static void
+xwait(const struct timespec *start, long deadline)
+{
+	struct pollfd pfd = { .fd = ConnectionNumber(dpy), .events = POLLIN };
+	long ms;
 
-		items[i].id = i; /* for multiselect */
+	XFlush(dpy);
+	while ((ms = deadline - msince(start)) > 0)
+		if (poll(&pfd, 1, ms) > 0 && XPending(dpy))
+			return;
+}
+
+static void
+grabfocus(void)
+{
+	struct timespec start;
+	Window focuswin;
+	int revertwin;
+	long t, wait;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (wait = 1; ; wait = MIN(wait * 2, 64)) {
+		XGetInputFocus(dpy, &focuswin, &revertwin);
+		if (focuswin == win)
+			return;
+		XSetInputFocus(dpy, win, RevertToParent, CurrentTime);
+		if ((t = msince(&start)) >= 1000)
+			die("cannot grab focus");
+		/* our FocusIn ends the wait early */
+		xwait(&start, t + wait);
+	}
+}
+
+static void
+grabkeyboard(void)
+{
+	struct timespec start;
+	long t, wait;
+
+	if (embed)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* try to grab keyboard, we may have to wait for another process to
+	 * ungrab: retry with exponential backoff or once X has news for us */
+	for (wait = 1; ; wait = MIN(wait * 2, 64)) {
+		if (XGrabKeyboard(dpy, DefaultRootWindow(dpy), True, GrabModeAsync,
+		                  GrabModeAsync, CurrentTime) == GrabSuccess)
+			return;
+		if ((t = msince(&start)) >= 1000)
+			die("cannot grab keyboard");
+		xwait(&start, t + wait);
+	}
+}
+
+/* with frame_rate set, holds a redraw back until a frame period has passed
+ * since the last one; returns 1 if events came in meanwhile */
+static int
+pace(void)
+{
+	struct pollfd pfd = { .fd = ConnectionNumber(dpy), .events = POLLIN };
+	long ms;
+
+	if (frame_rate <= 0)
+		return 0;
+	for (;;) {
+		if ((ms = 1000 / frame_rate - msince(&lastframe)) <= 0)
+			return 0;
+		if (poll(&pfd, 1, ms) > 0 && XPending(dpy))
+			return 1;
 	}
-	free(line);
-	if (items)
-		items[i].text = NULL;
-	lines = MIN(lines, i);
 }
 
+/* load glyphs and fallback fonts of the surrounding pages until an event
+ * comes in, waiting for the lookups drw runs in the background; -c and -L
+ * input and timers are left to feed(), which runs next */
+static void
+warm(void)
+{
+	struct pollfd pfd[3] = {
+		{ .fd = ConnectionNumber(dpy), .events = POLLIN },
+		{ .events = POLLIN },
+		{ .events = POLLIN }
+	};
+
+	while (warmpos < warmend && !XPending(dpy)) {
+		if (drw_prefetch(drw, itemshow(matches[warmpos]))) {
+			if (provpending || feeddirty)
+				return;
+			/* the first lookup may have only now started the thread */
+			pfd[1].fd = drw_prefetch_fd(drw);
+			pfd[2].fd = feedfd;
+			if (poll(pfd, 3, -1) > 0 && pfd[2].revents)
+				return;
+			continue;
+		}
+		drw_fontset_getwidth(drw, itemshow(matches[warmpos]));
+		warmpos = WARMNEXT(warmpos);
+	}
+}
+
+/* -c: takes in one chunk of the command's output */
+static void
+readfeed(void)
+{
+	unsigned int i, n;
+	int r;
+
+	if (provfresh) {
+		clearitems();
+		provfresh = 0;
+	}
+	n = nitems;
+	if (!(r = readitems(feedfd))) {
+		close(feedfd);
+		feedfd = -1;
+	}
+	if (itemprior && !live)
+		for (i = n; i < nitems; i++)
+			if (itemprior[i] > 0)
+				itemprior[i] = log2f(1 + itemprior[i]);
+	if (nitems > matchsiz && !(matches = realloc(matches, (matchsiz = itemsiz) * sizeof(*matches))))
+		die("cannot realloc %zu bytes:", matchsiz * sizeof(*matches));
+	growscores(nitems);
+	/* -L marks what matched as it came in */
+	feeddirty |= r != -1 && !live;
+}
+
+/* -c: starts the command once the query has settled for provider_delay ms
+ * and takes in its output, matching and drawing at most once per
+ * provider_delay, until an X event comes in */
+static void
+feed(void)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = ConnectionNumber(dpy), .events = POLLIN },
+		{ .events = POLLIN }
+	};
+	unsigned int c, s;
+	long ms, due;
+
+	while (!XPending(dpy)) {
+		ms = -1;
+		if (provpending) {
+			if ((due = provider_delay - msince(&provchanged)) <= 0) {
+				startprovider();
+				continue;
+			}
+			ms = due;
+		}
+		if (feeddirty) {
+			if ((due = provider_delay - msince(&feeddrawn)) <= 0 || feedfd == -1) {
+				/* the selection stays where it was among the new matches */
+				c = curr;
+				s = sel;
+				if (!live)
+					matcher(0, nitems);
+				if (s < nmatches) {
+					curr = c;
+					sel = s;
+				} else {
+					curr = sel = 0;
+				}
+				calcoffsets();
+				drawmenu();
+				clock_gettime(CLOCK_MONOTONIC, &feeddrawn);
+				feeddirty = 0;
+				continue;
+			}
+			ms = ms == -1 ? due : MIN(ms, due);
+		}
+		if (!provpending && !feeddirty && feedfd == -1)
+			return;
+		pfd[1].fd = feedfd;
+		if (poll(pfd, 2, ms) > 0 && pfd[1].revents)
+			readfeed();
+	}
+}
+
+#ifdef ALLOCCHECK
+/* counts the allocations of the main thread, the others load and sort;
+ * glibc keeps its own under these names */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+static pthread_t mainthread;
+static unsigned long nallocs;
+
+void *
+malloc(size_t n)
+{
+	nallocs += pthread_equal(pthread_self(), mainthread) != 0;
+	return __libc_malloc(n);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	nallocs += pthread_equal(pthread_self(), mainthread) != 0;
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t n)
+{
+	nallocs += pthread_equal(pthread_self(), mainthread) != 0;
+	return __libc_realloc(p, n);
+}
+#endif
+
 static void
 run(void)
 {
 	XEvent ev;
+#ifdef ALLOCCHECK
+	unsigned long n;
+#endif
 
-	while (!XNextEvent(dpy, &ev)) {
+	for (;;) {
+		warm();
+		if (provider || live)
+			feed();
+		if (XNextEvent(dpy, &ev))
+			break;
 		if (XFilterEvent(&ev, win))
 			continue;
 		switch(ev.type) {
@@ -947,7 +2724,7 @@ run(void)
 			break;
 		case Expose:
 			if (ev.xexpose.count == 0)
-				drw_map(drw, win, 0, 0, mw, mh);
+				exposed = 1;
 			break;
 		case FocusIn:
 			/* regrab focus from parent window */
@@ -955,7 +2732,15 @@ run(void)
 				grabfocus();
 			break;
 		case KeyPress:
+#ifdef ALLOCCHECK
+			/* none once warm; new glyphs still go through Xft */
+			n = nallocs;
 			keypress(&ev.xkey);
+			if (nallocs != n)
+				fprintf(stderr, "dmenu: keystroke made %lu allocations\n", nallocs - n);
+#else
+			keypress(&ev.xkey);
+#endif
 			break;
 		case SelectionNotify:
 			if (ev.xselection.property == utf8)
@@ -966,13 +2751,23 @@ run(void)
 				XRaiseWindow(dpy, win);
 			break;
 		}
+		/* apply all queued events before drawing, and draw once */
+		if (XPending(dpy) || (redraw && pace()))
+			continue;
+		if (redraw) {
+			drawmenu();
+			clock_gettime(CLOCK_MONOTONIC, &lastframe);
+		} else if (exposed) {
+			drw_map(drw, win, 0, 0, mw, mh);
+		}
+		redraw = exposed = 0;
 	}
 }
 
 static void
 setup(void)
 {
-	int x, y, i, j;
+	int x, y, i;
 	unsigned int du;
 	XSetWindowAttributes swa;
 	XIM xim;
@@ -982,17 +2777,8 @@ setup(void)
 #ifdef XINERAMA
 	XineramaScreenInfo *info;
 	Window pw;
-	int a, di, n, area = 0;
+	int a, di, j, n, area = 0;
 #endif
-	/* init appearance */
-
-	unsigned int alphas[2] = { OPAQUE, alpha };
-	for (j = 0; j < SchemeLast; j++)
-		scheme[j] = drw_scm_create(drw, colors[j], alphas, 2);
-
-	clip = XInternAtom(dpy, "CLIPBOARD",   False);
-	utf8 = XInternAtom(dpy, "UTF8_STRING", False);
-
 	/* calculate menu geometry */
 	bh = drw->fonts->h;
 	bh = item_height ? bh + item_height : bh + 2;
@@ -1051,7 +2837,7 @@ setup(void)
 	swa.border_pixel = 0;
 	swa.colormap = cmap;
 	swa.event_mask = ExposureMask | KeyPressMask | VisibilityChangeMask |
-	                 ButtonPressMask;
+	                 ButtonPressMask | FocusChangeMask;
 	win = XCreateWindow(dpy, root, x, y, mw, mh, border_width,
 	                    depth, CopyFromParent, visual,
 	                    CWOverrideRedirect | CWBackPixel | CWBorderPixel | CWColormap | CWEventMask, &swa);
@@ -1082,13 +2868,37 @@ setup(void)
 	drawmenu();
 }
 
+static void
+phase(const char *name)
+{
+	struct timespec now;
+
+	if (!timing)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stderr, "dmenu: %8.2fms %s\n", (now.tv_sec - starttime.tv_sec) * 1e3 +
+	        (now.tv_nsec - starttime.tv_nsec) / 1e6, name);
+}
+
+/* loads the items while the main thread sets up X, which it alone uses */
+static void *
+reader(void *arg)
+{
+	readstdin();
+	phase("items loaded");
+	return NULL;
+}
+
 static void
 usage(void)
 {
-	die("usage: dmenu [-bfvsiP] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
+	die("usage: dmenu [-bfvsiurtTP0Bx] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
 	    "           [-nhb color] [-nhf color] [-shb color] [-shf color] [-nb color]\n"
       "           [-nf color] [-sb color] [-sf color] [-w windowid] [-it text ]\n"
-      "           [-W width] [-F number] [-M number] [-n number] [-ix number]");
+      "           [-W width] [-F number] [-M number] [-n number] [-ix number]\n"
+	    "           [-I indexfile] [-H histfile] [-q cachefile] [-fc fontcache]\n"
+	    "           [-c command] [-L lines] [-d delim] [-mf field] [-df field]\n"
+	    "           [-of field]");
 }
 
 
@@ -1112,8 +2922,13 @@ int
 main(int argc, char *argv[])
 {
 	XWindowAttributes wa;
+	pthread_t rt;
 	int i, fast = 0;
 
+	clock_gettime(CLOCK_MONOTONIC, &starttime);
+#ifdef ALLOCCHECK
+	mainthread = pthread_self();
+#endif
 	const char *config_file = strcat(getenv("XDG_CONFIG_HOME"), dmenu_cfg);
 	FILE* fp = fopen(config_file, "r");
 	if(fp) {
@@ -1123,7 +2938,15 @@ main(int argc, char *argv[])
 
 		if (conf) {
 			cfg_read_int(conf, "fuzzy", &fuzzy);
+			cfg_read_int(conf, "regex", &regex);
+			cfg_read_int(conf, "execute", &execute);
 			cfg_read_int(conf, "multiselect", &multiselect);
+			cfg_read_int(conf, "dedup", &dedup);
+			cfg_read_int(conf, "history_size", &histsize);
+			cfg_read_int(conf, "history_halflife", &histhalflife);
+			cfg_read_int(conf, "query_cache_size", &qcachesize);
+			cfg_read_int(conf, "frame_rate", &frame_rate);
+			cfg_read_int(conf, "provider_delay", &provider_delay);
 			cfg_read_int(conf, "min_width", &min_width);
 			cfg_read_int(conf, "print_index", &print_index);
 			cfg_read_int(conf, "show_numbers", &show_numbers);
@@ -1164,10 +2987,26 @@ main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "-P"))   /* is the input a password */
 			passwd = 1;
 		else if (!strcmp(argv[i], "-s")) { /* case-sensitive item matching */
+			sensitive = 1;
 			fstrncmp = strncmp;
-			fstrstr = strstr;
 		} else if (!strcmp(argv[i], "-i")) /* input-less */
 			input = 0;
+		else if (!strcmp(argv[i], "-u"))   /* drop duplicate lines */
+			dedup = 1;
+		else if (!strcmp(argv[i], "-r"))   /* the query is a regular expression */
+			regex = 1;
+		else if (!strcmp(argv[i], "-x"))   /* run the selection */
+			execute = 1;
+		else if (!strcmp(argv[i], "-T"))   /* report startup timing */
+			timing = 1;
+		else if (!strcmp(argv[i], "-0"))   /* NUL-separated input and output */
+			delim = outsep = '\0';
+		else if (!strcmp(argv[i], "-t"))   /* leading weight column */
+			weighted = 1;
+		else if (!strcmp(argv[i], "-B")) { /* length-prefixed input records */
+			framed = 1;
+			outsep = '\0';
+		}
 		else if (i + 1 == argc) {
 			cleanup_cfg();
 			usage();
@@ -1207,6 +3046,26 @@ main(int argc, char *argv[])
 			colors[SchemeSelHighlight][ColFg] = argv[++i];
 		else if (!strcmp(argv[i], "-w"))   /* embedding window id */
 			embed = argv[++i];
+		else if (!strcmp(argv[i], "-I"))   /* read items from an index */
+			indexfile = argv[++i];
+		else if (!strcmp(argv[i], "-H"))   /* rank by and record history */
+			histfile = argv[++i];
+		else if (!strcmp(argv[i], "-q"))   /* cache results of short queries */
+			qcachefile = argv[++i];
+		else if (!strcmp(argv[i], "-fc"))  /* remember fallback fonts */
+			fontcachefile = argv[++i];
+		else if (!strcmp(argv[i], "-c"))   /* run a command for the items */
+			provider = argv[++i];
+		else if (!strcmp(argv[i], "-L"))   /* keep the newest lines of a feed */
+			live = MAX(atoi(argv[++i]), 1);
+		else if (!strcmp(argv[i], "-d"))   /* split records into fields */
+			fielddelim = argv[++i][0];
+		else if (!strcmp(argv[i], "-mf"))  /* field to match */
+			matchfield = MAX(atoi(argv[++i]), 0);
+		else if (!strcmp(argv[i], "-df"))  /* field to display */
+			showfield = MAX(atoi(argv[++i]), 0);
+		else if (!strcmp(argv[i], "-of"))  /* field to print */
+			outfield = MAX(atoi(argv[++i]), 0);
 		else if (!strcmp(argv[i], "-W"))   /* overwrite minimum width */
 			min_width = atoi(argv[++i]);
 		else if (!strcmp(argv[i], "-it")) {   /* initial text */
@@ -1218,8 +3077,37 @@ main(int argc, char *argv[])
 			usage();
 		}
 
+	/* -c and -L items keep changing, caching results is pointless */
+	if (provider || live)
+		qcachefile = NULL;
+	if (live) {
+		provider = NULL;
+		dedup = 0;
+		fielddelim = 0;
+	}
+	/* -I items are whole paths, the index has no fields */
+	if (indexfile && !provider && !live)
+		fielddelim = 0;
+
+	/* the mode is fixed from here on, so is the match loop */
+	if (regex)
+		matcher = regexmatch;
+	else if (fuzzy)
+		matcher = sensitive ? fuzzymatch_cs : fuzzymatch_ci;
+	else
+		matcher = sensitive ? tokenmatch_cs : tokenmatch_ci;
+	/* -x keeps what it would print, to run it once the window is gone */
+	if (!execute)
+		out = stdout;
+	else if (!(out = open_memstream(&runbuf, &runlen)))
+		die("open_memstream:");
+
 	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
 		fputs("warning: no locale support\n", stderr);
+	phase("configured");
+	/* stdin is read and indexed while display, fonts and colors load */
+	if ((errno = pthread_create(&rt, NULL, reader, NULL)))
+		die("pthread_create:");
 	if (!(dpy = XOpenDisplay(NULL))) {
 		cleanup_cfg();
 		die("cannot open display");
@@ -1234,30 +3122,52 @@ main(int argc, char *argv[])
 		    parentwin);
 	}
 	xinitvisual();
+	phase("display open");
 	drw = drw_create(dpy, screen, root, wa.width, wa.height, visual, depth, cmap);
 	if (!drw_fontset_create(drw, fonts, LENGTH(fonts))) {
 		cleanup_cfg();
 		die("no fonts could be loaded.");
 	}
+	if (fontcachefile)
+		loadfontcache();
+	phase("fonts loaded");
 
 	lrpad = drw->fonts->h;
 	if (border_padding > 0) {
 		lrpad += border_padding*2;
 	}
 
+	/* init appearance */
+	unsigned int alphas[2] = { OPAQUE, alpha };
+	for (i = 0; i < SchemeLast; i++)
+		scheme[i] = drw_scm_create(drw, colors[i], alphas, 2);
+
+	clip = XInternAtom(dpy, "CLIPBOARD",   False);
+	utf8 = XInternAtom(dpy, "UTF8_STRING", False);
+	phase("colors loaded");
+
 #ifdef __OpenBSD__
-	if (pledge("stdio rpath", NULL) == -1)
+	char promises[64] = "stdio rpath";
+
+	if (histfile || qcachefile || fontcachefile)
+		strcat(promises, " wpath cpath");
+	if (provider || execute)
+		strcat(promises, " proc exec");
+	if (pledge(promises, NULL) == -1)
 		die("pledge");
 #endif
 
-	if (fast && !isatty(0)) {
+	/* -f grabs the keyboard while stdin may still be coming in */
+	if (fast && !isatty(0))
 		grabkeyboard();
-		readstdin();
-	} else {
-		readstdin();
+	if ((errno = pthread_join(rt, NULL)))
+		die("pthread_join:");
+	phase("items ready");
+	if (!(fast && !isatty(0)))
 		grabkeyboard();
-	}
+	phase("keyboard grabbed");
 	setup();
+	phase("menu drawn");
 	run();
 
 	return 1; /* unreachable */
@@ -0,0 +1,538 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arg.h"
+#include "idx.h"
+#include "util.h"
+char *argv0;
+
+#define MAXTHREADS 8
+#define SETTLEMS   100  /* -w: wait for a burst of changes to end */
+#define RETRYMS    1000 /* -w: look again for directories that went away */
+
+struct dir {
+	const char *path;
+	char **names;         /* executables in this directory */
+	size_t n, siz;
+	int64_t mtime;        /* nanoseconds, when it was scanned */
+	int wd;               /* -w: inotify watch */
+	int lost;             /* -w: not there, watched for again */
+};
+
+static void usage(void);
+
+static struct dir *dirs;
+static size_t ndirs, nextdir;
+static pthread_mutex_t dirlock = PTHREAD_MUTEX_INITIALIZER;
+static const char *cachefile, *indexfile;
+
+static int64_t
+mtimens(const struct stat *st)
+{
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static void
+addname(struct dir *d, const char *name)
+{
+	if (d->n == d->siz) {
+		d->siz = d->siz ? d->siz * 2 : 256;
+		if (!(d->names = realloc(d->names, d->siz * sizeof(*d->names))))
+			die("cannot realloc %zu bytes:", d->siz * sizeof(*d->names));
+	}
+	if (!(d->names[d->n++] = strdup(name)))
+		die("strdup:");
+}
+
+/* same test as stest -fx: not hidden, a regular file after following links
+ * and executable by the real user */
+static void
+testentry(struct dir *d, int dfd, const char *name, int type)
+{
+	struct stat st;
+
+	if (name[0] == '.')
+		return;
+	if (type == DT_DIR || (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN))
+		return;
+	if (type != DT_REG && (fstatat(dfd, name, &st, 0) == -1 || !S_ISREG(st.st_mode)))
+		return;
+	if (faccessat(dfd, name, X_OK, 0) == 0)
+		addname(d, name);
+}
+
+#ifdef __linux__
+struct linux_dirent64 {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static void
+scandirfd(struct dir *d, int dfd)
+{
+	char buf[32768];
+	struct linux_dirent64 *e;
+	long n, off;
+
+	/* getdents64 hands out d_type, so most entries need no stat at all */
+	while ((n = syscall(SYS_getdents64, dfd, buf, sizeof buf)) > 0) {
+		for (off = 0; off < n; off += e->d_reclen) {
+			e = (struct linux_dirent64 *)(buf + off);
+			testentry(d, dfd, e->d_name, e->d_type);
+		}
+	}
+}
+#else
+static void
+scandirfd(struct dir *d, int dfd)
+{
+	DIR *dp;
+	struct dirent *e;
+
+	if (!(dp = fdopendir(dup(dfd))))
+		return;
+	while ((e = readdir(dp)))
+		testentry(d, dfd, e->d_name, DT_UNKNOWN);
+	closedir(dp);
+}
+#endif
+
+static void
+scan(struct dir *d)
+{
+	struct stat st;
+	int dfd;
+
+	if (!stat(d->path, &st))
+		d->mtime = mtimens(&st);
+	if ((dfd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		/* like stest -l: an entry that is no directory is tested itself */
+		if (d->path[0] != '.' && !stat(d->path, &st) && S_ISREG(st.st_mode) &&
+		    !access(d->path, X_OK))
+			addname(d, d->path);
+		return;
+	}
+	scandirfd(d, dfd);
+	close(dfd);
+}
+
+static void *
+worker(void *arg)
+{
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&dirlock);
+		i = nextdir++;
+		pthread_mutex_unlock(&dirlock);
+		if (i >= ndirs)
+			return NULL;
+		scan(&dirs[i]);
+	}
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	const char *sa = *(char *const *)a, *sb = *(char *const *)b;
+	int r;
+
+	/* the same order sort(1) uses in the current locale */
+	return (r = strcoll(sa, sb)) ? r : strcmp(sa, sb);
+}
+
+/* the index records each directory's mtime, so it also notices changes
+ * within the same second and a $PATH that changed */
+static int
+staleindex(void)
+{
+	struct idxheader h;
+	struct idxdir *dir;
+	struct stat st;
+	char *map, *blob;
+	size_t i;
+	int fd, r = 1;
+
+	if ((fd = open(indexfile, O_RDONLY | O_CLOEXEC)) == -1)
+		return 1;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof h ||
+	    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	memcpy(&h, map, sizeof h);
+	blob = map + IDXBLOB(h.nitems);
+	dir = (struct idxdir *)(map + IDXDIRS(h.nitems, h.bloblen));
+	if (memcmp(h.magic, IDXMAGIC, 4) || h.ndirs != ndirs ||
+	    IDXSIZE(h.nitems, h.bloblen, ndirs) > (size_t)st.st_size)
+		goto end;
+	for (i = 0; i < ndirs; i++) {
+		if (dir[i].path >= h.bloblen || strcmp(blob + dir[i].path, dirs[i].path) ||
+		    dir[i].mtime != (stat(dirs[i].path, &st) ? 0 : mtimens(&st)))
+			goto end;
+	}
+	r = 0;
+end:
+	munmap(map, st.st_size);
+	return r;
+}
+
+/* same test as stest -dqr -n cache $PATH */
+static int
+stale(const char *cache)
+{
+	struct stat cst, st;
+	int hascache = !stat(cache, &cst);
+	size_t i;
+
+	if (indexfile && hascache)
+		return staleindex();
+
+	for (i = 0; i < ndirs; i++)
+		if (dirs[i].path[0] != '.' && !stat(dirs[i].path, &st) &&
+		    S_ISDIR(st.st_mode) && !access(dirs[i].path, R_OK) &&
+		    (!hascache || st.st_mtime > cst.st_mtime))
+			return 1;
+	return 0;
+}
+
+static void
+writeall(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	for (; len; buf += n, len -= n)
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			die("write:");
+		}
+}
+
+/* write to a temporary file next to the target and rename it over the
+ * target, so readers never see a partial file */
+static void
+writefile(const char *file, const char *buf, size_t len)
+{
+	char tmp[PATH_MAX];
+	mode_t mask;
+	int fd;
+
+	if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", file) >= (int)sizeof tmp)
+		die("%s: path too long", file);
+	if ((fd = mkstemp(tmp)) == -1)
+		die("mkstemp %s:", tmp);
+	umask(mask = umask(0));
+	fchmod(fd, 0666 & ~mask);
+	writeall(fd, buf, len);
+	if (close(fd) == -1 || rename(tmp, file) == -1) {
+		unlink(tmp);
+		die("cannot write %s:", file);
+	}
+}
+
+static void
+writeindex(char **names, size_t n)
+{
+	struct idxheader h;
+	struct idxdir *dir;
+	uint32_t *off, *len;
+	unsigned char *flags, ascii;
+	char *buf, *blob, *p;
+	size_t i, bloblen = 0, siz;
+
+	for (i = 0; i < n; i++)
+		bloblen += strlen(names[i]) + 1;
+	for (i = 0; i < ndirs; i++)
+		bloblen += strlen(dirs[i].path) + 1;
+	if (bloblen > UINT32_MAX)
+		die("index too large");
+	siz = IDXSIZE(n, bloblen, ndirs);
+	buf = ecalloc(1, siz);
+
+	memcpy(h.magic, IDXMAGIC, 4);
+	h.nitems = n;
+	h.ndirs = ndirs;
+	h.bloblen = bloblen;
+	memcpy(buf, &h, sizeof h);
+	off = (uint32_t *)(buf + sizeof h);
+	len = off + n;
+	flags = (unsigned char *)(len + n);
+	p = blob = buf + IDXBLOB(n);
+	dir = (struct idxdir *)(buf + IDXDIRS(n, bloblen));
+	for (i = 0; i < n; i++) {
+		off[i] = p - blob;
+		len[i] = strlen(names[i]);
+		for (ascii = 0, p = names[i]; *p; p++)
+			ascii |= *p;
+		flags[i] = ascii < 0x80 ? IDX_ASCII : 0;
+		p = stpcpy(blob + off[i], names[i]) + 1;
+	}
+	for (i = 0; i < ndirs; i++) {
+		dir[i].path = p - blob;
+		dir[i].mtime = dirs[i].mtime;
+		p = stpcpy(p, dirs[i].path) + 1;
+	}
+	writefile(indexfile, buf, siz);
+	free(buf);
+}
+
+static void
+scanall(void)
+{
+	pthread_t threads[MAXTHREADS];
+	size_t i, nthreads = MIN(ndirs, MAXTHREADS);
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, worker, NULL))
+			die("pthread_create:");
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/* merges the directories into the cache text and writes cache and index */
+static char *
+build(size_t *outlen)
+{
+	char **all, *out, *p;
+	size_t i, j, n = 0, len = 0;
+
+	for (i = 0; i < ndirs; i++)
+		n += dirs[i].n;
+	all = ecalloc(n ? n : 1, sizeof(*all));
+	for (i = 0, n = 0; i < ndirs; i++)
+		for (j = 0; j < dirs[i].n; j++)
+			all[n++] = dirs[i].names[j];
+	qsort(all, n, sizeof(*all), compare);
+
+	/* drop duplicates, as sort -u does for lines that collate equal */
+	for (i = 0, j = 0; i < n; i++)
+		if (!j || strcoll(all[j - 1], all[i]))
+			all[j++] = all[i];
+	for (i = 0; i < j; i++)
+		len += strlen(all[i]) + 1;
+	p = out = ecalloc(len ? len : 1, 1);
+	for (i = 0; i < j; i++) {
+		p = stpcpy(p, all[i]);
+		*p++ = '\n';
+	}
+	writefile(cachefile, out, len);
+	if (indexfile)
+		writeindex(all, j);
+	free(all);
+	*outlen = len;
+	return out;
+}
+
+#ifdef __linux__
+/* -w: keep cache and index current by applying single directory entry
+ * changes reported by inotify, instead of rescanning $PATH */
+static void
+update(struct dir *d, const char *name)
+{
+	struct stat st;
+	size_t i;
+	int dfd;
+
+	for (i = 0; i < d->n; i++) {
+		if (!strcmp(d->names[i], name)) {
+			free(d->names[i]);
+			d->names[i] = d->names[--d->n];
+			break;
+		}
+	}
+	if ((dfd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return;
+	testentry(d, dfd, name, DT_UNKNOWN);
+	if (!fstat(dfd, &st))
+		d->mtime = mtimens(&st);
+	close(dfd);
+}
+
+static int
+addwatch(int fd, struct dir *d)
+{
+	d->wd = inotify_add_watch(fd, d->path,
+	        IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+	        IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF |
+	        IN_ONLYDIR);
+	/* only a missing directory may turn up later, a file never will */
+	d->lost = d->wd == -1 && errno == ENOENT;
+	return d->wd != -1;
+}
+
+static void
+watch(void)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+	     __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct pollfd pfd;
+	size_t i, d, len, nlost = 0;
+	ssize_t n;
+	int dirty = 0;
+
+	if ((pfd.fd = inotify_init1(IN_CLOEXEC)) == -1)
+		die("inotify_init1:");
+	pfd.events = POLLIN;
+	for (i = 0; i < ndirs; i++)
+		addwatch(pfd.fd, &dirs[i]);
+
+	for (;;) {
+		for (d = 0, nlost = 0; d < ndirs; d++)
+			nlost += dirs[d].lost;
+		if (poll(&pfd, 1, dirty ? SETTLEMS : nlost ? RETRYMS : -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			die("poll:");
+		}
+		if (!(pfd.revents & POLLIN)) {
+			for (d = 0; d < ndirs; d++)
+				if (dirs[d].lost && addwatch(pfd.fd, &dirs[d])) {
+					/* read once watched, so no entry is missed */
+					scan(&dirs[d]);
+					dirty = 1;
+				}
+			/* the burst is over, write once */
+			if (dirty)
+				free(build(&len));
+			dirty = 0;
+			continue;
+		}
+		if ((n = read(pfd.fd, buf, sizeof buf)) <= 0)
+			continue;
+		for (i = 0; i < (size_t)n; i += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)(buf + i);
+			for (d = 0; d < ndirs && dirs[d].wd != ev->wd; d++)
+				;
+			if (d == ndirs)
+				continue;
+			if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				/* a moved directory is still watched where it went */
+				if (ev->mask & IN_MOVE_SELF)
+					inotify_rm_watch(pfd.fd, ev->wd);
+				while (dirs[d].n)
+					free(dirs[d].names[--dirs[d].n]);
+				dirs[d].wd = -1;
+				dirs[d].mtime = 0;
+				dirs[d].lost = 1;
+			} else if (ev->len) {
+				update(&dirs[d], ev->name);
+			}
+			dirty = 1;
+		}
+	}
+}
+#endif
+
+static char *
+readcache(const char *cache, size_t *outlen)
+{
+	FILE *fp;
+	char *buf = NULL;
+	size_t len = 0, siz = 0, n;
+
+	if (!(fp = fopen(cache, "r")))
+		die("fopen %s:", cache);
+	do {
+		if (len == siz && !(buf = realloc(buf, siz = siz ? siz * 2 : BUFSIZ)))
+			die("cannot realloc %zu bytes:", siz);
+		len += (n = fread(buf + len, 1, siz - len, fp));
+	} while (n);
+	fclose(fp);
+	*outlen = len;
+	return buf;
+}
+
+static void
+usage(void)
+{
+	die("usage: %s [-fow] [-i indexfile] cachefile", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *path, *p, *list;
+	size_t len;
+	int force = 0, print = 0, watching = 0;
+
+	ARGBEGIN {
+	case 'f': /* rebuild even if the cache is up to date */
+		force = 1;
+		break;
+	case 'i': /* also write a binary index for dmenu -I */
+		indexfile = EARGF(usage());
+		break;
+	case 'o': /* print the list to stdout */
+		print = 1;
+		break;
+	case 'w': /* stay running and follow changes to $PATH */
+#ifndef __linux__
+		die("-w needs inotify");
+#endif
+		watching = 1;
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc != 1)
+		usage();
+	cachefile = argv[0];
+	setlocale(LC_ALL, "");
+
+	path = strdup(getenv("PATH") ? getenv("PATH") : "");
+	for (p = path, ndirs = 1; *p; p++)
+		ndirs += *p == ':';
+	dirs = ecalloc(ndirs, sizeof(*dirs));
+	for (p = path, ndirs = 0; p; ndirs++) {
+		dirs[ndirs].path = p;
+		if ((p = strchr(p, ':')))
+			*p++ = '\0';
+	}
+
+	if (watching) {
+		scanall();
+		free(build(&len));
+#ifdef __linux__
+		watch();
+#endif
+	}
+	if (force || stale(cachefile)) {
+		scanall();
+		list = build(&len);
+	} else if (print) {
+		list = readcache(cachefile, &len);
+	} else {
+		return 0;
+	}
+	if (print)
+		writeall(1, list, len);
+	return 0;
+}
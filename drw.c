@@ -1,7 +1,11 @@
 /* See LICENSE file for copyright and license details. */
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 
@@ -10,6 +14,21 @@
 
 #define UTF_INVALID 0xFFFD
 
+/* fallback fonts looked up ahead of drawing by a fontconfig thread */
+struct Prefetch {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	FcPattern *base; /* first font, substituted as for XftFontMatch() */
+	struct {
+		long u;
+		FcPattern *match; /* once done, NULL if nothing matched */
+		int done;
+	} *ent;
+	size_t n, siz, next; /* next is the first entry not looked up */
+	int wake[2], quit;   /* a byte in wake per lookup done */
+};
+
 static int
 utf8decode(const char *s_in, long *u, int *err)
 {
@@ -25,7 +44,14 @@ utf8decode(const char *s_in, long *u, int *err)
 	static const unsigned int overlong[] = { 0x0, 0x80, 0x0800, 0x10000 };
 
 	const unsigned char *s = (const unsigned char *)s_in;
-	int len = lens[*s >> 3];
+	int len;
+
+	if (*s < 0x80) { /* ASCII fast path */
+		*u = *s;
+		*err = 0;
+		return 1;
+	}
+	len = lens[*s >> 3];
 	*u = UTF_INVALID;
 	*err = 1;
 	if (len == 0)
@@ -46,6 +72,140 @@ utf8decode(const char *s_in, long *u, int *err)
 	return len;
 }
 
+static void *
+prefetcher(void *arg)
+{
+	struct Prefetch *pf = arg;
+	FcPattern *pattern, *match;
+	FcCharSet *cs;
+	FcResult result;
+	size_t i, j;
+	long u;
+
+	pthread_mutex_lock(&pf->lock);
+	for (;;) {
+		while (pf->next < pf->n && pf->ent[pf->next].done)
+			pf->next++;
+		if (pf->quit)
+			break;
+		if (pf->next == pf->n) {
+			pthread_cond_wait(&pf->cond, &pf->lock);
+			continue;
+		}
+		u = pf->ent[i = pf->next].u;
+		pthread_mutex_unlock(&pf->lock);
+
+		pattern = FcPatternDuplicate(pf->base);
+		cs = FcCharSetCreate();
+		FcCharSetAddChar(cs, u);
+		FcPatternAddCharSet(pattern, FC_CHARSET, cs);
+		match = FcFontMatch(NULL, pattern, &result);
+		FcCharSetDestroy(cs);
+		FcPatternDestroy(pattern);
+
+		pthread_mutex_lock(&pf->lock);
+		pf->ent[i].match = match;
+		pf->ent[i].done = 1;
+		/* the font likely serves more of the queue */
+		if (match && FcPatternGetCharSet(match, FC_CHARSET, 0, &cs) == FcResultMatch)
+			for (j = i + 1; j < pf->n; j++)
+				if (!pf->ent[j].done && FcCharSetHasChar(cs, pf->ent[j].u)) {
+					FcPatternReference(match);
+					pf->ent[j].match = match;
+					pf->ent[j].done = 1;
+				}
+		if (write(pf->wake[1], "", 1) == -1) {
+			/* full, the reader is woken anyway */
+		}
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return NULL;
+}
+
+static void
+prefetch_stop(struct Prefetch *pf)
+{
+	size_t i;
+
+	if (!pf)
+		return;
+	if (!pf->quit) {
+		pthread_mutex_lock(&pf->lock);
+		pf->quit = 1;
+		pthread_cond_signal(&pf->cond);
+		pthread_mutex_unlock(&pf->lock);
+		pthread_join(pf->thread, NULL);
+	}
+	for (i = 0; i < pf->n; i++)
+		if (pf->ent[i].match)
+			FcPatternDestroy(pf->ent[i].match);
+	if (pf->wake[0] != -1) {
+		close(pf->wake[0]);
+		close(pf->wake[1]);
+	}
+	pthread_mutex_destroy(&pf->lock);
+	pthread_cond_destroy(&pf->cond);
+	FcPatternDestroy(pf->base);
+	free(pf->ent);
+	free(pf);
+}
+
+static struct Prefetch *
+prefetch_start(Drw *drw)
+{
+	struct Prefetch *pf;
+	FcPattern *base;
+
+	if (!drw->fonts->pattern)
+		return NULL;
+	base = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddBool(base, FC_SCALABLE, FcTrue);
+	FcConfigSubstitute(NULL, base, FcMatchPattern);
+	FcDefaultSubstitute(base);
+	/* what XftFontMatch() adds, it needs the display */
+	FcConfigSubstitute(NULL, base, FcMatchPattern);
+	XftDefaultSubstitute(drw->dpy, drw->screen, base);
+
+	pf = ecalloc(1, sizeof(*pf));
+	pf->base = base;
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+	if (pipe(pf->wake) == -1) {
+		pf->wake[0] = pf->wake[1] = -1;
+		goto fail;
+	}
+	fcntl(pf->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(pf->wake[1], F_SETFL, O_NONBLOCK);
+	if (pthread_create(&pf->thread, NULL, prefetcher, pf))
+		goto fail;
+	return (drw->prefetch = pf);
+fail:
+	pf->quit = 1;
+	prefetch_stop(pf);
+	return NULL;
+}
+
+/* the font the prefetcher matched for codepoint u, NULL if it has not */
+static FcPattern *
+prefetched(Drw *drw, long u)
+{
+	struct Prefetch *pf = drw->prefetch;
+	FcPattern *match = NULL;
+	size_t i;
+
+	if (!pf)
+		return NULL;
+	pthread_mutex_lock(&pf->lock);
+	for (i = 0; i < pf->n; i++)
+		if (pf->ent[i].u == u) {
+			if (pf->ent[i].done && (match = pf->ent[i].match))
+				FcPatternReference(match);
+			break;
+		}
+	pthread_mutex_unlock(&pf->lock);
+	return match;
+}
+
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h, Visual *visual, unsigned int depth, Colormap cmap)
 {
@@ -77,14 +237,23 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, drw->depth);
+	if (drw->xftdraw)
+		XftDrawChange(drw->xftdraw, drw->drawable);
 }
 
 void
 drw_free(Drw *drw)
 {
+	if (drw->xftdraw)
+		XftDrawDestroy(drw->xftdraw);
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
+	prefetch_stop(drw->prefetch);
 	drw_fontset_free(drw->fonts);
+	while (drw->nfbpats)
+		free(drw->fbpats[--drw->nfbpats]);
+	free(drw->fbpats);
+	free(drw->fbranges);
 	free(drw);
 }
 
@@ -169,6 +338,279 @@ drw_fontset_free(Fnt *font)
 	}
 }
 
+static unsigned long long
+fnv(unsigned long long h, const void *p, size_t n)
+{
+	const unsigned char *s = p;
+
+	while (n--)
+		h = (h ^ *s++) * 0x100000001b3ULL;
+	return h;
+}
+
+/* fallbacks hold while the fonts asked for, their size and the fontconfig
+ * caches and configuration stay the same */
+static unsigned long long
+fallback_key(Drw *drw)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	double px = 0;
+	struct stat st;
+	FcStrList *l;
+	FcChar8 *s;
+	Fnt *f;
+	int i;
+
+	for (f = drw->fonts; f; f = f->next) {
+		if (!f->pattern || !(s = FcNameUnparse(f->pattern)))
+			continue;
+		h = fnv(h, s, strlen((char *)s) + 1);
+		free(s);
+	}
+	FcPatternGetDouble(drw->fonts->xfont->pattern, FC_PIXEL_SIZE, 0, &px);
+	h = fnv(h, &px, sizeof(px));
+	for (i = 0; i < 2; i++) {
+		if (!(l = i ? FcConfigGetConfigFiles(NULL) : FcConfigGetCacheDirs(NULL)))
+			continue;
+		while ((s = FcStrListNext(l))) {
+			h = fnv(h, s, strlen((char *)s) + 1);
+			if (!stat((char *)s, &st)) {
+				h = fnv(h, &st.st_mtim.tv_sec, sizeof(st.st_mtim.tv_sec));
+				h = fnv(h, &st.st_mtim.tv_nsec, sizeof(st.st_mtim.tv_nsec));
+			}
+		}
+		FcStrListDone(l);
+	}
+	return h;
+}
+
+/* index of the first range that ends at or after u */
+static size_t
+fallback_find(Drw *drw, long u)
+{
+	size_t lo = 0, hi = drw->nfbranges, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (drw->fbranges[mid].hi < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* index of pattern s, which is taken over */
+static int
+fallback_pat(Drw *drw, char *s)
+{
+	int i;
+
+	for (i = 0; i < drw->nfbpats; i++)
+		if (!strcmp(drw->fbpats[i], s)) {
+			free(s);
+			return i;
+		}
+	if (!(drw->fbpats = realloc(drw->fbpats, (i + 1) * sizeof(*drw->fbpats))))
+		die("cannot realloc %zu bytes:", (i + 1) * sizeof(*drw->fbpats));
+	drw->fbpats[drw->nfbpats++] = s;
+	return i;
+}
+
+static void
+fallback_insert(Drw *drw, size_t i, long lo, long hi, int pat)
+{
+	if (drw->nfbranges == drw->fbrangesiz) {
+		drw->fbrangesiz = drw->fbrangesiz ? drw->fbrangesiz * 2 : 16;
+		if (!(drw->fbranges = realloc(drw->fbranges, drw->fbrangesiz * sizeof(*drw->fbranges))))
+			die("cannot realloc %zu bytes:", drw->fbrangesiz * sizeof(*drw->fbranges));
+	}
+	memmove(drw->fbranges + i + 1, drw->fbranges + i, (drw->nfbranges++ - i) * sizeof(*drw->fbranges));
+	drw->fbranges[i].lo = lo;
+	drw->fbranges[i].hi = hi;
+	drw->fbranges[i].pat = pat;
+}
+
+static void
+fallback_remove(Drw *drw, size_t i)
+{
+	memmove(drw->fbranges + i, drw->fbranges + i + 1, (--drw->nfbranges - i) * sizeof(*drw->fbranges));
+}
+
+/* remember that codepoint u falls back to pattern pat */
+static void
+fallback_set(Drw *drw, long u, int pat)
+{
+	size_t i = fallback_find(drw, u);
+	FbRange *r;
+
+	drw->fbdirty = 1;
+	if (i < drw->nfbranges && drw->fbranges[i].lo <= u) {
+		r = &drw->fbranges[i];
+		if (r->pat == pat)
+			return;
+		/* cut u out of a range that went stale */
+		if (r->lo == r->hi) {
+			fallback_remove(drw, i);
+		} else if (r->lo == u) {
+			r->lo++;
+		} else if (r->hi == u) {
+			r->hi--;
+			i++;
+		} else {
+			fallback_insert(drw, i + 1, u + 1, r->hi, r->pat);
+			drw->fbranges[i++].hi = u - 1;
+		}
+	}
+	fallback_insert(drw, i, u, u, pat);
+	r = drw->fbranges;
+	if (i + 1 < drw->nfbranges && r[i + 1].pat == pat && r[i + 1].lo == u + 1) {
+		r[i].hi = r[i + 1].hi;
+		fallback_remove(drw, i + 1);
+	}
+	if (i > 0 && r[i - 1].pat == pat && r[i - 1].hi == u - 1) {
+		r[i - 1].hi = r[i].hi;
+		fallback_remove(drw, i);
+	}
+}
+
+/* record the font, or NULL for none, that codepoint u fell back to */
+static void
+fallback_add(Drw *drw, long u, XftFont *xfont)
+{
+	FcChar8 *s;
+
+	if (!xfont)
+		fallback_set(drw, u, -1);
+	else if ((s = FcNameUnparse(xfont->pattern)))
+		fallback_set(drw, u, fallback_pat(drw, (char *)s));
+}
+
+/* look codepoint u up in the fallbacks of earlier runs: 1 with *font opened
+ * if its font still has it, -1 if no font had it, 0 if unknown */
+static int
+fallback_open(Drw *drw, long u, Fnt **font)
+{
+	size_t i = fallback_find(drw, u);
+	FcPattern *pattern;
+	Fnt *f;
+
+	if (i == drw->nfbranges || drw->fbranges[i].lo > u)
+		return 0;
+	if (drw->fbranges[i].pat < 0)
+		return -1;
+	if (!(pattern = FcNameParse((FcChar8 *)drw->fbpats[drw->fbranges[i].pat])))
+		return 0;
+	if (!(f = xfont_create(drw, NULL, pattern))) {
+		FcPatternDestroy(pattern);
+		return 0;
+	}
+	if (!XftCharExists(drw->dpy, f->xfont, u)) {
+		xfont_free(f);
+		return 0;
+	}
+	*font = f;
+	return 1;
+}
+
+void
+drw_fallback_load(Drw *drw, FILE *fp)
+{
+	unsigned long long key;
+	char *line = NULL, *p, *end, *pat = NULL;
+	size_t size = 0;
+	ssize_t len;
+	long lo, hi, last = -1;
+
+	if (!drw || !drw->fonts)
+		return;
+	drw->fbkey = fallback_key(drw);
+	if (!fp || getline(&line, &size, fp) == -1 ||
+	    sscanf(line, "DMF1 %llx", &key) != 1 || key != drw->fbkey) {
+		free(line);
+		return;
+	}
+	/* "lo hi\tpattern" in codepoint order, no pattern if no font had them */
+	while ((len = getline(&line, &size, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		lo = strtol(line, &p, 16);
+		hi = strtol(p, &end, 16);
+		if (p == line || end == p || *end != '\t' || lo <= last || hi < lo ||
+		    (end[1] && !(pat = strdup(end + 1))))
+			break;
+		fallback_insert(drw, drw->nfbranges, lo, hi, end[1] ? fallback_pat(drw, pat) : -1);
+		last = hi;
+	}
+	free(line);
+}
+
+void
+drw_fallback_write(Drw *drw, FILE *fp)
+{
+	size_t i;
+
+	fprintf(fp, "DMF1 %016llx\n", drw->fbkey);
+	for (i = 0; i < drw->nfbranges; i++)
+		fprintf(fp, "%lx %lx\t%s\n", drw->fbranges[i].lo, drw->fbranges[i].hi,
+		        drw->fbranges[i].pat < 0 ? "" : drw->fbpats[drw->fbranges[i].pat]);
+}
+
+/* queue fallback font lookups for the characters of text that no loaded font
+ * has, drw_text() then finds them done; returns how many are still pending.
+ * drw_prefetch_fd() becomes readable as lookups finish */
+int
+drw_prefetch(Drw *drw, const char *text)
+{
+	struct Prefetch *pf;
+	char buf[64];
+	int err, pending = 0;
+	size_t i;
+	long u;
+	Fnt *f;
+
+	if (!drw || !drw->fonts || !text)
+		return 0;
+	if ((pf = drw->prefetch))
+		while (read(pf->wake[0], buf, sizeof(buf)) > 0)
+			;
+	while (*text) {
+		text += utf8decode(text, &u, &err);
+		if (err)
+			continue;
+		for (f = drw->fonts; f && !XftCharExists(drw->dpy, f->xfont, u); f = f->next)
+			;
+		i = fallback_find(drw, u);
+		if (f || (i < drw->nfbranges && drw->fbranges[i].lo <= u))
+			continue;
+		if (!pf && !(pf = prefetch_start(drw)))
+			return 0;
+		pthread_mutex_lock(&pf->lock);
+		for (i = 0; i < pf->n && pf->ent[i].u != u; i++)
+			;
+		if (i == pf->n) {
+			if (pf->n == pf->siz) {
+				pf->siz = pf->siz ? pf->siz * 2 : 64;
+				if (!(pf->ent = realloc(pf->ent, pf->siz * sizeof(*pf->ent))))
+					die("cannot realloc %zu bytes:", pf->siz * sizeof(*pf->ent));
+			}
+			pf->ent[pf->n].u = u;
+			pf->ent[pf->n].match = NULL;
+			pf->ent[pf->n++].done = 0;
+			pthread_cond_signal(&pf->cond);
+		}
+		pending += !pf->ent[i].done;
+		pthread_mutex_unlock(&pf->lock);
+	}
+	return pending;
+}
+
+int
+drw_prefetch_fd(Drw *drw)
+{
+	return drw && drw->prefetch ? drw->prefetch->wake[0] : -1;
+}
+
 void
 drw_clr_create(Drw *drw, Clr *dest, const char *clrname, unsigned int alpha)
 {
@@ -276,7 +718,10 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
 		if (w < lpad)
 			return x + w;
-		d = XftDrawCreate(drw->dpy, drw->drawable, drw->visual, drw->cmap);
+		/* kept, an XftDraw per call would allocate on every redraw */
+		if (!drw->xftdraw)
+			drw->xftdraw = XftDrawCreate(drw->dpy, drw->drawable, drw->visual, drw->cmap);
+		d = drw->xftdraw;
 		x += lpad;
 		w -= lpad;
 	}
@@ -366,24 +811,38 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 			if (nomatches[h0] == utf8codepoint || nomatches[h1] == utf8codepoint)
 				goto no_match;
 
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
+			/* a font an earlier run fell back to saves the lookup */
+			switch (fallback_open(drw, utf8codepoint, &usedfont)) {
+			case -1:
+				goto no_match;
+			case 1:
+				for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
+					; /* NOP */
+				curfont->next = usedfont;
+				continue;
 			}
 
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+			/* or one drw_prefetch() already looked up */
+			if (!(match = prefetched(drw, utf8codepoint))) {
+				fccharset = FcCharSetCreate();
+				FcCharSetAddChar(fccharset, utf8codepoint);
+
+				if (!drw->fonts->pattern) {
+					/* Refer to the comment in xfont_create for more information. */
+					die("the first font in the cache must be loaded from a font string.");
+				}
+
+				fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+				FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+				FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
 
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+				FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+				FcDefaultSubstitute(fcpattern);
+				match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
 
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
+				FcCharSetDestroy(fccharset);
+				FcPatternDestroy(fcpattern);
+			}
 
 			if (match) {
 				usedfont = xfont_create(drw, NULL, match);
@@ -391,18 +850,17 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
 						; /* NOP */
 					curfont->next = usedfont;
+					fallback_add(drw, utf8codepoint, usedfont->xfont);
 				} else {
 					xfont_free(usedfont);
 					nomatches[nomatches[h0] ? h1 : h0] = utf8codepoint;
+					fallback_add(drw, utf8codepoint, NULL);
 no_match:
 					usedfont = drw->fonts;
 				}
 			}
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
-
 	return x + (render ? w : 0);
 }
 
@@ -15,6 +15,12 @@ typedef struct Fnt {
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
+/* codepoints lo to hi fall back to font pattern pat, -1 if no font has them */
+typedef struct {
+	long lo, hi;
+	int pat;
+} FbRange;
+
 typedef struct {
 	unsigned int w, h;
 	Display *dpy;
@@ -24,9 +30,16 @@ typedef struct {
 	unsigned int depth;
 	Colormap cmap;
 	Drawable drawable;
+	XftDraw *xftdraw; /* of drawable, made on first use */
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	FbRange *fbranges;
+	size_t nfbranges, fbrangesiz;
+	char **fbpats;
+	int nfbpats, fbdirty;
+	unsigned long long fbkey;
+	struct Prefetch *prefetch;
 } Drw;
 
 /* Drawable abstraction */
@@ -41,6 +54,12 @@ unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
 unsigned int drw_fontset_getwidth_clamp(Drw *drw, const char *text, unsigned int n);
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
 
+/* Fallback font cache */
+void drw_fallback_load(Drw *drw, FILE *fp);
+void drw_fallback_write(Drw *drw, FILE *fp);
+int drw_prefetch(Drw *drw, const char *text);
+int drw_prefetch_fd(Drw *drw);
+
 /* Colorscheme abstraction */
 void drw_clr_create(Drw *drw, Clr *dest, const char *clrname, unsigned int alpha);
 void drw_clr_free(Drw *drw, Clr *c);
@@ -0,0 +1,36 @@
+/* See LICENSE file for copyright and license details. */
+
+/*
+ * Binary item index written by dmenu_cache -i and mapped by dmenu -I.
+ * Everything is in native byte order and laid out so dmenu can use the
+ * arrays in place as its item store:
+ *
+ *	struct idxheader
+ *	uint32_t off[nitems]     offset of each text in the blob
+ *	uint32_t len[nitems]     length of each text
+ *	uint8_t  flags[nitems]   IDX_ASCII, padded to a multiple of 4 bytes
+ *	char     blob[bloblen]   NUL-terminated texts, then directory paths
+ *	struct idxdir dirs[ndirs] at the next multiple of 8 bytes
+ */
+
+#define IDXMAGIC      "DMI1"
+#define IDX_ASCII     1  /* text is pure ASCII */
+#define IDXPAD(n, a)  (((n) + (a) - 1) / (a) * (a))
+
+/* file offsets of the sections */
+#define IDXBLOB(n)        (sizeof(struct idxheader) + (size_t)(n) * 8 + IDXPAD((size_t)(n), 4))
+#define IDXDIRS(n, blen)  IDXPAD(IDXBLOB(n) + (blen), 8)
+#define IDXSIZE(n, blen, ndirs)  (IDXDIRS(n, blen) + (size_t)(ndirs) * sizeof(struct idxdir))
+
+struct idxheader {
+	char magic[4];
+	uint32_t nitems;
+	uint32_t ndirs;
+	uint32_t bloblen;
+};
+
+struct idxdir {
+	int64_t mtime;   /* of the directory when it was scanned */
+	uint32_t path;   /* offset of the path in the blob */
+	uint32_t pad;
+};
@@ -0,0 +1,215 @@
+/* See LICENSE file for copyright and license details. */
+
+/*
+ * Match loops, specialized per matching mode by including this file several
+ * times. With FOLD(c) defined it yields the kernels K(prefix), K(find) and
+ * K(fuzzy), which compare FOLD() of the item bytes against a pattern that
+ * is already folded. SCAN(s, n, c) may name a faster way to find the first
+ * of n bytes that folds to c, a plain loop is used otherwise. Without FOLD
+ * it yields the match set builders D(tokenmatch) and D(fuzzymatch), which
+ * match the items from up to to: QFOLD(c) folds the query and KERN(name, id)
+ * names the kernel to use for item id. D(tokenmatch) tests the terms of the
+ * query in the order planterms() gives them, leaving those planac() takes
+ * to its automaton, over the items prefixrun() allows if it can tell.
+ */
+
+#ifdef FOLD
+
+#ifndef SCAN
+static const char *
+K(scan)(const char *s, size_t n, char c)
+{
+	const char *end = s + n;
+
+	for (; s < end; s++)
+		if (FOLD(*s) == c)
+			return s;
+	return NULL;
+}
+#define SCAN K(scan)
+#endif
+
+static int
+K(prefix)(const char *s, const char *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (FOLD(s[i]) != p[i])
+			return 0;
+	return 1;
+}
+
+/* is p, of n > 0 bytes, somewhere in s */
+static int
+K(find)(const char *s, size_t len, const char *p, size_t n)
+{
+	const char *end;
+
+	if (n > len)
+		return 0;
+	for (end = s + len - n + 1; (s = SCAN(s, end - s, p[0])); s++)
+		if (K(prefix)(s + 1, p + 1, n - 1))
+			return 1;
+	return 0;
+}
+
+/* are the n > 0 bytes of p in s in order; sidx and eidx get the positions
+ * of the first and the last */
+static int
+K(fuzzy)(const char *s, size_t len, const char *p, size_t n, int *sidx, int *eidx)
+{
+	const char *t = s, *end = s + len;
+	size_t j;
+
+	for (j = 0; j < n; j++) {
+		if (!(t = SCAN(t, end - t, p[j])))
+			return 0;
+		if (!j)
+			*sidx = t - s;
+		*eidx = t++ - s;
+	}
+	return 1;
+}
+
+#undef FOLD
+#undef SCAN
+#undef K
+
+#else
+
+static void
+D(tokenmatch)(unsigned int from, unsigned int to)
+{
+	/* as many as text can hold, tokens being a byte and a space apart */
+	static struct term terms[sizeof text / 2 + 1];
+
+	char q[sizeof text], buf[sizeof text], *s, *itext;
+	int i, cls, hit, ops = 0, qascii = 1, tokc = 0;
+	unsigned int k, n, id, *run = NULL, nweighted = 0;
+	size_t len, ilen;
+	uint64_t want, reject;
+	struct term *t;
+	Ac *ac;
+
+	/* fold the query once, the kernels only fold the items */
+	for (len = 0; text[len]; len++) {
+		q[len] = buf[len] = QFOLD(text[len]);
+		qascii &= (unsigned char)text[len] < 0x80;
+	}
+	q[len] = buf[len] = '\0';
+	/* separate input text into tokens to be matched individually */
+	for (s = strtok(buf, " "); s; s = strtok(NULL, " ")) {
+		ops |= parseterm(&terms[tokc], s, !tokc);
+		tokc++;
+	}
+	planterms(terms, tokc);
+	/* many terms anywhere are found in one scan, after the anchored ones */
+	ac = planac(terms, &tokc, &want, &reject, qascii);
+	/* a prefix takes its run of the sorted items, unless an exact match
+	 * need not start with it */
+	if (!from && to == nitems && (ops || q[0] != ' '))
+		run = prefixrun(terms, tokc, &n);
+
+	nmatches = 0;
+	for (k = 0, n = run ? n : to - from; k < n; k++) {
+		id = run ? run[k] : from + k;
+		itext = ITEMTEXT(id);
+		ilen = itemlen[id];
+		/* class 0 is an exact match, 1 an item that passes every term;
+		 * unweighted, both land in matches in input order */
+		if (!tokc && !ac) {
+			cls = 1;
+		} else if (!ops && ilen == len && KERN(prefix, id)(itext, q, len)) {
+			cls = 0;
+		} else {
+			for (i = 0, t = terms; i < tokc; i++, t++) {
+				switch (t->kind) {
+				case TermFind:
+					hit = KERN(find, id)(itext, ilen, t->s, t->len);
+					break;
+				case TermPrefix:
+					hit = t->len <= ilen && KERN(prefix, id)(itext, t->s, t->len);
+					break;
+				case TermSuffix:
+					hit = t->len <= ilen && KERN(prefix, id)(itext + ilen - t->len, t->s, t->len);
+					break;
+				default:
+					hit = t->len == ilen && KERN(prefix, id)(itext, t->s, t->len);
+				}
+				if (hit == t->neg)
+					break;
+			}
+			if (i != tokc || (ac && !ac_match(ac, itext, ilen, want, reject)))
+				continue; /* a term rejects the item */
+			cls = 1;
+		}
+		/* with priors the class comes first, then the prior: exact
+		 * matches, weighted or not, rank ahead of the other weighted
+		 * items, and the unweighted rest stays behind in input order */
+		if (itemprior && (itemprior[id] > 0 || !cls)) {
+			growscores(nweighted + 1);
+			scores[nweighted++] = scorekey((cls ? 0 : -EXACTRANK) - itemprior[id], id);
+		} else {
+			matches[nmatches++] = id;
+		}
+	}
+	placeweighted(nweighted);
+}
+
+static void
+D(fuzzymatch)(unsigned int from, unsigned int to)
+{
+	char q[sizeof text];
+	unsigned int id, nweighted = 0;
+	int i, sidx, eidx, qascii = 1;
+	int text_len = strlen(text);
+	float distance;
+
+	nmatches = 0;
+
+	/* fold the query once, the kernels only fold the items */
+	for (i = 0; i < text_len; i++) {
+		q[i] = QFOLD(text[i]);
+		qascii &= (unsigned char)text[i] < 0x80;
+	}
+
+	/* walk through all items */
+	for (id = from; id < to; id++) {
+		if (!text_len) {
+			if (itemprior && itemprior[id] > 0) {
+				growscores(nweighted + 1);
+				scores[nweighted++] = scorekey(-itemprior[id], id);
+			} else {
+				matches[nmatches++] = id;
+			}
+			continue;
+		}
+		if (!KERN(fuzzy, id)(ITEMTEXT(id), itemlen[id], q, text_len, &sidx, &eidx))
+			continue;
+		/* compute distance */
+		/* add penalty if match starts late (log(sidx+2))
+		 * add penalty for long a match without many matching characters */
+		distance = log(sidx + 2) + (double)(eidx - sidx - text_len);
+		/* the prior weighs against the distance in the same sort */
+		if (itemprior)
+			distance -= itemprior[id];
+		growscores(nmatches + 1);
+		scores[nmatches++] = scorekey(distance, id);
+	}
+
+	if (text_len) {
+		/* sort matches according to distance */
+		sortscores(nscored = nmatches);
+		for (i = 0; i < nmatches; i++)
+			matches[i] = (unsigned int)scores[i];
+	} else {
+		placeweighted(nweighted);
+	}
+}
+
+#undef QFOLD
+#undef KERN
+#undef D
+
+#endif